@@ -0,0 +1,372 @@
+/*
+ * job_bench - Time tsh's spawn path and job control through a pty
+ *
+ * Runs the shell on a pseudo-terminal, types at it the way a user
+ * would, and times how long it takes to answer:
+ *
+ *    gcc -O2 -o job_bench bench/job_bench.c -lutil
+ *    ./job_bench [-n count] [-r rounds] [-j jobs] [-o file] [shell [args...]]
+ *
+ * The shell defaults to ./tsh and the results go to bench_output.txt,
+ * one "name value unit" line each, so runs can be compared with diff.
+ *
+ *    true.*     /bin/true typed count times, each timed from the
+ *               newline to the next prompt
+ *    spawn.*    a foreground job, from the newline to its first output
+ *    tstp.*     ctrl-z on that job, to the "stopped" report and prompt
+ *    bg.*       bg %1, to the job running again and the prompt
+ *    fg.*       fg %1, to the job receiving its SIGCONT
+ *    int.*      ctrl-c, to the "terminated" report and prompt
+ *    bgjobs.*   jobs background sleeps started, then /bin/true and
+ *               jobs timed with all of them live, then all of them
+ *               killed at once and timed until the last is reported;
+ *               the shell only reports them at a prompt, so newlines
+ *               are typed until it has
+ *
+ * The foreground job is this program run with -c: it reports on its
+ * standard output when it starts and on every SIGCONT, so each step
+ * is timed to an event rather than to a guess.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BUFSIZE  65536
+#define TIMEOUT  5000   /* ms to wait for any one answer */
+
+int ptyfd;              /* master side of the shell's terminal */
+pid_t shellpid;
+char buf[BUFSIZE];      /* shell output since the last mark() */
+size_t buflen;
+FILE *out;
+int warmup;             /* don't report anything yet */
+
+/* nsnow - Monotonic time in nanoseconds */
+static long long nsnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* die - Report an error and stop the shell */
+void die(const char *msg) {
+    fprintf(stderr, "job_bench: %s\n", msg);
+    if (buflen > 0)
+        fprintf(stderr, "shell output so far:\n%.*s\n", (int)buflen, buf);
+    if (shellpid > 0)
+        kill(shellpid, SIGKILL);
+    exit(1);
+}
+
+/*
+ * child - The foreground job (-c): says when it is ready and when it
+ *    is continued, and otherwise just waits for signals
+ */
+void cont_handler(int sig) {
+    write(STDOUT_FILENO, "cont\n", 5);
+}
+
+int child(void) {
+    signal(SIGCONT, cont_handler);
+    write(STDOUT_FILENO, "ready\n", 6);
+    for (;;)
+        pause();
+}
+
+/* startshell - Run argv on a new pty with echo turned off */
+void startshell(char **argv) {
+    struct termios tio;
+
+    if ((shellpid = forkpty(&ptyfd, NULL, NULL, NULL)) < 0)
+        die("forkpty failed");
+    if (shellpid == 0) {
+        execv(argv[0], argv);
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    tcgetattr(ptyfd, &tio);
+    tio.c_lflag &= ~ECHO;
+    tcsetattr(ptyfd, TCSANOW, &tio);
+}
+
+/* mark - Forget the output read so far */
+void mark(void) {
+    buflen = 0;
+    buf[0] = '\0';
+}
+
+/* fill - Read more output, waiting at most timeout ms; 0 on timeout */
+int fill(int timeout) {
+    struct pollfd p = { ptyfd, POLLIN, 0 };
+    ssize_t n;
+
+    if (poll(&p, 1, timeout) <= 0)
+        return 0;
+    if (buflen == BUFSIZE - 1)      /* keep the tail, markers are short */
+        mark();
+    if ((n = read(ptyfd, buf + buflen, BUFSIZE - 1 - buflen)) <= 0)
+        die("shell exited");
+    buflen += n;
+    buf[buflen] = '\0';
+    return 1;
+}
+
+/* count - Occurrences of s in the output since mark() */
+int count(const char *s) {
+    const char *p = buf;
+    int n = 0;
+
+    while ((p = strstr(p, s)) != NULL) {
+        n++;
+        p += strlen(s);
+    }
+    return n;
+}
+
+/* expectn - Wait until s has appeared n times since mark() */
+void expectn(const char *s, int n) {
+    long long end = nsnow() + (long long)TIMEOUT * 1000000;
+
+    while (count(s) < n) {
+        if (nsnow() > end || !fill(TIMEOUT)) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "timed out waiting for \"%s\"", s);
+            die(msg);
+        }
+    }
+}
+
+/* expect - Wait for one s since mark() */
+void expect(const char *s) {
+    expectn(s, 1);
+}
+
+/* type - Send s to the shell as if typed */
+void type(const char *s) {
+    if (write(ptyfd, s, strlen(s)) != (ssize_t)strlen(s))
+        die("write to shell failed");
+}
+
+/* cmp - qsort() order for sample arrays */
+int cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* report - One result line, to the output file and to stdout */
+void report(const char *name, const char *what, double value, const char *unit) {
+    char key[64];
+
+    if (warmup)
+        return;
+    snprintf(key, sizeof(key), "%s.%s", name, what);
+    fprintf(out, "%-20s %12.1f %s\n", key, value, unit);
+    printf("%-20s %12.1f %s\n", key, value, unit);
+}
+
+/* summary - Median, 90th percentile and worst of n samples in us */
+void summary(const char *name, long long *t, int n) {
+    qsort(t, n, sizeof(*t), cmp);
+    report(name, "p50", t[n / 2] / 1e3, "us");
+    report(name, "p90", t[n * 9 / 10] / 1e3, "us");
+    report(name, "max", t[n - 1] / 1e3, "us");
+}
+
+/*
+ * killed - Jobs reported killed since mark(): one for each "Job ...
+ *    terminated by signal" line, n for a "n jobs terminated by signal"
+ *    summary, which is what the shell prints past a batch of them
+ */
+int killed(void) {
+    const char *s = "terminated by signal", *p = buf, *line;
+    int n = 0;
+
+    while ((p = strstr(p, s)) != NULL) {
+        for (line = p; line > buf && line[-1] != '\n'; line--)
+            ;
+        n += isdigit((unsigned char)*line) ? atoi(line) : 1;
+        p += strlen(s);
+    }
+    return n;
+}
+
+/* bench_true - Round trips of /bin/true, and the rate they give */
+void bench_true(const char *name, int n) {
+    long long *t = malloc(n * sizeof(*t)), t0, start = nsnow();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        mark();
+        t0 = nsnow();
+        type("/bin/true\n");
+        expect("tsh> ");
+        t[i] = nsnow() - t0;
+    }
+    report(name, "rate", n / ((nsnow() - start) / 1e9), "cmd/s");
+    summary(name, t, n);
+    free(t);
+}
+
+/* bench_jobctl - Time each job-control step, rounds times over */
+void bench_jobctl(const char *self, int rounds) {
+    long long *t[5], t0;
+    char cmd[4200];
+    int i, k;
+
+    for (k = 0; k < 5; k++)
+        t[k] = malloc(rounds * sizeof(long long));
+    snprintf(cmd, sizeof(cmd), "%s -c\n", self);
+
+    for (i = 0; i < rounds; i++) {
+        mark();
+        t0 = nsnow();
+        type(cmd);
+        expect("ready");
+        t[0][i] = nsnow() - t0;
+
+        mark();
+        t0 = nsnow();
+        type("\032");                       /* ctrl-z */
+        expect("stopped by signal");
+        expect("tsh> ");
+        t[1][i] = nsnow() - t0;
+
+        mark();
+        t0 = nsnow();
+        type("bg %1\n");
+        expect("cont");
+        expect("tsh> ");
+        t[2][i] = nsnow() - t0;
+
+        mark();
+        t0 = nsnow();
+        type("fg %1\n");
+        expect("cont");
+        t[3][i] = nsnow() - t0;
+
+        mark();
+        t0 = nsnow();
+        type("\003");                       /* ctrl-c */
+        expect("terminated by signal");
+        expect("tsh> ");
+        t[4][i] = nsnow() - t0;
+    }
+    summary("spawn", t[0], rounds);
+    summary("tstp", t[1], rounds);
+    summary("bg", t[2], rounds);
+    summary("fg", t[3], rounds);
+    summary("int", t[4], rounds);
+    for (k = 0; k < 5; k++)
+        free(t[k]);
+}
+
+/* bench_bgjobs - Behaviour with njobs background jobs in the table */
+void bench_bgjobs(int njobs, int n) {
+    pid_t *pids = malloc(njobs * sizeof(*pids));
+    long long t0, *t = malloc(n * sizeof(*t));
+    char *p;
+    int i;
+
+    t0 = nsnow();
+    for (i = 0; i < njobs; i++) {
+        mark();
+        type("/bin/sleep 1000 &\n");
+        expect("tsh> ");
+        if ((p = strchr(buf, '(')) == NULL || (pids[i] = atoi(p + 1)) <= 0)
+            die("no pid for a background job");
+    }
+    report("bgjobs", "start", (nsnow() - t0) / 1e3 / njobs, "us/job");
+
+    bench_true("bgjobs.true", n);
+
+    for (i = 0; i < n / 10 + 1; i++) {
+        mark();
+        t0 = nsnow();
+        type("jobs\n");
+        expect("tsh> ");
+        t[i] = nsnow() - t0;
+    }
+    summary("bgjobs.jobs", t, n / 10 + 1);
+
+    mark();
+    t0 = nsnow();
+    for (i = 0; i < njobs; i++)
+        kill(pids[i], SIGTERM);
+    while (killed() < njobs) {
+        if (nsnow() - t0 > (long long)TIMEOUT * 1000000)
+            die("timed out waiting for \"terminated by signal\"");
+        i = count("tsh> ");
+        type("\n");
+        expectn("tsh> ", i + 1);
+    }
+    report("bgjobs", "reap", (nsnow() - t0) / 1e3, "us");
+    free(pids);
+    free(t);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: job_bench [-n count] [-r rounds] [-j jobs] [-o file] [shell [args...]]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *deftsh[] = { "./tsh", NULL }, **shell = deftsh;
+    char *outfile = "bench_output.txt", self[4096];
+    int n = 2000, rounds = 100, njobs = 64, c, i;
+    ssize_t len;
+
+    if (argc == 2 && strcmp(argv[1], "-c") == 0)
+        return child();
+    while ((c = getopt(argc, argv, "+n:r:j:o:")) != -1) {
+        switch (c) {
+            case 'n': n = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'j': njobs = atoi(optarg); break;
+            case 'o': outfile = optarg; break;
+            default: usage();
+        }
+    }
+    if (n < 1 || rounds < 1 || njobs < 1)
+        usage();
+    if (optind < argc)
+        shell = argv + optind;
+    if ((len = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0)
+        die("cannot find own executable");
+    self[len] = '\0';
+    if ((out = fopen(outfile, "w")) == NULL) {
+        perror(outfile);
+        return 1;
+    }
+
+    fprintf(out, "# job_bench:");
+    for (i = 0; shell[i] != NULL; i++)
+        fprintf(out, " %s", shell[i]);
+    fprintf(out, " (n %d, rounds %d, jobs %d)\n", n, rounds, njobs);
+
+    startshell(shell);
+    expect("tsh> ");
+    warmup = 1;
+    bench_true("true", n / 10 + 1);
+    warmup = 0;
+
+    bench_true("true", n);
+    bench_jobctl(self, rounds);
+    bench_bgjobs(njobs, n / 4 + 1);
+
+    type("quit\n");
+    waitpid(shellpid, NULL, 0);
+    fclose(out);
+    return 0;
+}
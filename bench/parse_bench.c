@@ -0,0 +1,280 @@
+/* 
+ * parse_bench - Time parseline() against the parser it replaced
+ *
+ * Builds the shell in with its main() renamed, so the parser under
+ * test is the one in tsh.c:
+ *
+ *    gcc -O2 -o parse_bench bench/parse_bench.c
+ *    ./parse_bench [iterations]
+ *    ./parse_bench -z [rounds]
+ *
+ * The old parser copied the line twice and stopped at MAXLINE bytes
+ * and 128 words, so it is only timed on lines that fit; the longer
+ * argument lists are timed for the new parser alone, with short and
+ * with path-like words, through the stop bitmap and byte by byte.
+ *
+ * -z fuzzes the vector stop scanners against scan_scalar(), and the
+ * tokenizer's bitmap path against its byte-by-byte path, on random
+ * lines. It exits non-zero at the first difference.
+ */
+#define main tsh_main
+#include "../tsh.c"
+#undef main
+
+#include <time.h>
+
+#define LEGACY_MAXARGS 128
+
+/* 
+ * legacy_parseline - The old parseline(), unchanged except for its name
+ */
+int legacy_parseline(const char *cmdline, char **argv) {
+    static char array[MAXLINE]; /* holds local copy of command line */
+    char *buf = array;          /* ptr that traverses command line */
+    char *delim;                /* points to space or quote delimiters */
+    int argc;                   /* number of args */
+    int bg;                     /* background job? */
+
+    strcpy(buf, cmdline);
+    strcat(buf, " ");          /* every word ends in a delimiter */
+    while (*buf && (*buf == ' ')) /* ignore leading spaces */
+        buf++;
+
+    /* Build the argv list */
+    argc = 0;
+    if (*buf == '\'') {
+        buf++;
+        delim = strchr(buf, '\'');
+    }
+    else {
+        delim = strchr(buf, ' ');
+    }
+
+    while (delim) {
+        argv[argc++] = buf;
+        *delim = '\0';
+        buf = delim + 1;
+        while (*buf && (*buf == ' ')) /* ignore spaces */
+            buf++;
+
+        if (*buf == '\'') {
+            buf++;
+            delim = strchr(buf, '\'');
+        }
+        else {
+            delim = strchr(buf, ' ');
+        }
+    }
+    argv[argc] = NULL;
+
+    if (argc == 0)  /* ignore blank line */
+        return 1;
+
+    /* should the job run in the background? */
+    if ((bg = (*argv[argc-1] == '&')) != 0)
+        argv[--argc] = NULL;
+
+    return bg;
+}
+
+/* now_ns - Monotonic time in nanoseconds */
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* makeline - Return "cmd <prefix>1 <prefix>2 ..." with nargs arguments */
+static char *makeline(int nargs, const char *prefix) {
+    char *line, *p;
+    int i;
+
+    if ((p = line = malloc(16 + (size_t)nargs * (strlen(prefix) + 8))) == NULL)
+        unix_error("makeline: malloc error");
+    p += sprintf(p, "cmd");
+    for (i = 1; i <= nargs; i++)
+        p += sprintf(p, " %s%d", prefix, i % 100000);
+    return line;
+}
+
+/* timeparse - ns per parseline() of line, best of a few runs */
+static double timeparse(const char *line, struct parse_t *ps, long n) {
+    double t0, t, best = 0;
+    int run;
+    long i;
+
+    for (run = 0; run < 5; run++) {
+        t0 = now_ns();
+        for (i = 0; i < n; i++)
+            parseline(line, ps);
+        t = (now_ns() - t0) / n;
+        if (run == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+/* randline - Fill line with n random bytes, heavy on stops, long runs mostly */
+static void randline(char *line, int n) {
+    static const char stops[] = " \t|&;<>'\"\\0123";
+    int i, run = 1 + rand() % 48;
+
+    for (i = 0; i < n; i++) {
+        if (rand() % run == 0)
+            line[i] = stops[rand() % (sizeof(stops) - 1)];
+        else if (rand() % 64 == 0)
+            line[i] = 0x80 + rand() % 0x80;  // Bytes with the top bit set
+        else
+            line[i] = 'a' + rand() % 26;
+        if (line[i] == '\0')
+            line[i] = 'z';
+    }
+    line[n] = '\0';
+}
+
+/* samestops - Do the first n bits of a and b agree? */
+static int samestops(const uint64_t *a, const uint64_t *b, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (((a[i >> 6] ^ b[i >> 6]) >> (i & 63)) & 1)
+            return 0;
+    }
+    return 1;
+}
+
+/* fuzz - Compare the vector paths with the scalar ones on random lines */
+static int fuzz(long rounds) {
+    static void (*scanners[])(const char *, int, uint64_t *) = {
+#if HAVE_SSE2
+        scan_sse2,
+#endif
+#if HAVE_AVX2
+        scan_avx2,
+#endif
+#if HAVE_NEON
+        scan_neon,
+#endif
+        scan_scalar,
+    };
+    struct parse_t sps, vps;
+    char line[4096 + SCANPAD], *copy;
+    uint64_t want[4096 / 64 + 2], got[4096 / 64 + 2];
+    int n, off, ns, nt, k, i;
+    long round;
+
+    memset(&sps, 0, sizeof(sps));
+    memset(&vps, 0, sizeof(vps));
+    ns = sizeof(scanners) / sizeof(scanners[0]) - 1;
+#if HAVE_AVX2
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2"))
+        for (k = 0; k < ns; k++)
+            if (scanners[k] == scan_avx2)
+                scanners[k] = scanners[--ns];
+#endif
+    srand(1);
+    freopen("/dev/null", "w", stdout); // Quote errors are expected
+
+    for (round = 0; round < rounds; round++) {
+        // Scanners, at every alignment
+        n = rand() % 4000;
+        off = rand() % 64;
+        randline(line + off, n);
+        memset(line + off + n + 1, 0, sizeof(line) - off - n - 1);
+        scan_scalar(line + off, n + 1, want);
+        for (k = 0; k < ns; k++) {
+            scanners[k](line + off, n + 1, got);
+            if (!samestops(want, got, n + 1)) {
+                fprintf(stderr, "fuzz: scanner %d disagrees on round %ld\n", k, round);
+                return 1;
+            }
+        }
+
+        // Tokens, through the bitmap and byte by byte
+        copy = line + off;
+        scan_force_scalar = 1;
+        nt = tokenize(copy, &sps);
+        scan_force_scalar = 0;
+        if (tokenize(copy, &vps) != nt) {
+            fprintf(stderr, "fuzz: token counts differ on round %ld\n", round);
+            return 1;
+        }
+        for (i = 0; i < nt; i++) {
+            struct token_t *a = &sps.toks[i], *b = &vps.toks[i];
+
+            if (a->type != b->type || a->fd != b->fd || a->len != b->len ||
+                a->start != b->start || a->end != b->end ||
+                (a->type == TK_WORD && memcmp(a->s, b->s, a->len + 1) != 0)) {
+                fprintf(stderr, "fuzz: token %d differs on round %ld\n", i, round);
+                return 1;
+            }
+        }
+    }
+    fprintf(stderr, "fuzz: %ld rounds, %d vector scanners, no differences\n", rounds, ns);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const int sizes[] = { 8, 32, 120, 1000, 10000, 100000 };
+    static const char *paths = "/usr/src/linux/drivers/gpu/drm/file";
+    char *largv[LEGACY_MAXARGS + 2];
+    char buf[MAXLINE];
+    struct parse_t ps;
+    long iters;
+    double t0, told, tnew, tpath, tscalar;
+    long i, n;
+    size_t k;
+    char *line;
+
+    if (argc > 1 && strcmp(argv[1], "-z") == 0)
+        return fuzz(argc > 2 ? atol(argv[2]) : 100000);
+    iters = argc > 1 ? atol(argv[1]) : 2000000;
+
+    memset(&ps, 0, sizeof(ps));
+    printf("%8s %8s %8s %12s %12s %12s %12s\n", "args", "bytes", "iters",
+           "old ns/line", "new ns/line", "paths", "paths scalar");
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        line = makeline(sizes[k], "a");
+        n = iters / sizes[k] + 1;
+
+        // Both parsers must agree on the words
+        parseline(line, &ps);
+        if (strlen(line) < MAXLINE - 1 && sizes[k] < LEGACY_MAXARGS) {
+            strcpy(buf, line);
+            legacy_parseline(buf, largv);
+            for (i = 0; largv[i] != NULL; i++) {
+                if (ps.pipes[0].cmds[0].argv[i] == NULL ||
+                    strcmp(largv[i], ps.pipes[0].cmds[0].argv[i]) != 0)
+                    app_error("parse_bench: parsers disagree");
+            }
+
+            t0 = now_ns();
+            for (i = 0; i < n; i++) {
+                strcpy(buf, line); // eval()'s copy
+                legacy_parseline(buf, largv);
+            }
+            told = (now_ns() - t0) / n;
+        } else {
+            told = 0;
+        }
+
+        tnew = timeparse(line, &ps, n);
+        if (told > 0)
+            printf("%8d %8zu %8ld %12.1f %12.1f", sizes[k], strlen(line), n, told, tnew);
+        else
+            printf("%8d %8zu %8ld %12s %12.1f", sizes[k], strlen(line), n, "-", tnew);
+        free(line);
+
+        // The same count of long words
+        line = makeline(sizes[k], paths);
+        tpath = timeparse(line, &ps, n);
+        scan_force_scalar = 1;
+        tscalar = timeparse(line, &ps, n);
+        scan_force_scalar = 0;
+        printf(" %12.1f %12.1f\n", tpath, tscalar);
+        free(line);
+    }
+    return 0;
+}
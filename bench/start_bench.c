@@ -0,0 +1,217 @@
+/*
+ * start_bench - Time how long tsh takes to start and to exit
+ *
+ * Starts the shell count times for each case and times it from just
+ * before the exec:
+ *
+ *    gcc -O2 -o start_bench bench/start_bench.c
+ *    ./start_bench [-n count] [-o file] [shell [args...]]
+ *
+ * The shell defaults to ./tsh and the results go to start_output.txt,
+ * one "name value unit" line each, as job_bench writes them. To see
+ * what the dynamic loader costs, time a static build as well:
+ *
+ *    gcc -O2 -static -o tsh-static tsh.c
+ *    ./start_bench -o static.txt ./tsh-static
+ *
+ *    floor.*    /bin/true itself, what any exec costs
+ *    prompt.*   to the first prompt, with stdin an empty pipe
+ *    eof.*      to exit, with stdin /dev/null
+ *    oneshot.*  to exit of "shell -c /bin/true"
+ *    list.*     to exit of "shell -c '/bin/true; /bin/true'": one
+ *               job, then the last command exec'd in place of the shell
+ */
+#define _GNU_SOURCE /* pipe2 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAXARGS 64
+
+extern char **environ;
+FILE *out;
+int warmup;             /* don't report anything yet */
+
+/* nsnow - Monotonic time in nanoseconds */
+static long long nsnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* die - Report an error, with errno's if it is set, and stop */
+void die(const char *msg) {
+    if (errno != 0)
+        fprintf(stderr, "start_bench: %s: %s\n", msg, strerror(errno));
+    else
+        fprintf(stderr, "start_bench: %s\n", msg);
+    exit(1);
+}
+
+/* cmp - qsort() order for sample arrays */
+int cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* report - One result line, to the output file and to stdout */
+void report(const char *name, const char *what, double value, const char *unit) {
+    char key[64];
+
+    if (warmup)
+        return;
+    snprintf(key, sizeof(key), "%s.%s", name, what);
+    fprintf(out, "%-20s %12.1f %s\n", key, value, unit);
+    printf("%-20s %12.1f %s\n", key, value, unit);
+}
+
+/* summary - Median, 90th percentile and worst of n samples in us */
+void summary(const char *name, long long *t, int n) {
+    qsort(t, n, sizeof(*t), cmp);
+    report(name, "p50", t[n / 2] / 1e3, "us");
+    report(name, "p90", t[n * 9 / 10] / 1e3, "us");
+    report(name, "max", t[n - 1] / 1e3, "us");
+}
+
+/*
+ * run - Start argv with stdin on infd and stdout on outfd (-1 for
+ *    /dev/null) and return its pid
+ */
+pid_t run(char **argv, int infd, int outfd) {
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&fa);
+    if (infd >= 0)
+        posix_spawn_file_actions_adddup2(&fa, infd, STDIN_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (outfd >= 0)
+        posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    if ((err = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ)) != 0) {
+        errno = err;
+        die(argv[0]);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    return pid;
+}
+
+/* bench_exit - Time argv from its start to its exit */
+void bench_exit(const char *name, char **argv, int n) {
+    long long *t = malloc(n * sizeof(*t)), t0;
+    int i, status;
+
+    for (i = 0; i < n; i++) {
+        t0 = nsnow();
+        waitpid(run(argv, -1, -1), &status, 0);
+        t[i] = nsnow() - t0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            errno = 0;
+            die("a run failed");
+        }
+    }
+    summary(name, t, n);
+    free(t);
+}
+
+/* bench_prompt - Time the shell from its start to its first prompt */
+void bench_prompt(char **argv, int n) {
+    long long *t = malloc(n * sizeof(*t)), t0;
+    char buf[256];
+    size_t got;
+    ssize_t k;
+    int in[2], outp[2], i;
+    pid_t pid;
+
+    for (i = 0; i < n; i++) {
+        if (pipe2(in, O_CLOEXEC) < 0 || pipe2(outp, O_CLOEXEC) < 0)
+            die("pipe");
+        t0 = nsnow();
+        pid = run(argv, in[0], outp[1]);
+        close(in[0]);
+        close(outp[1]);
+        for (got = 0; got < sizeof(buf) - 1; got += k) {
+            if ((k = read(outp[0], buf + got, sizeof(buf) - 1 - got)) <= 0) {
+                errno = 0;
+                die("no prompt");
+            }
+            buf[got + k] = '\0';
+            if (strstr(buf, "tsh> ") != NULL)
+                break;
+        }
+        t[i] = nsnow() - t0;
+        close(in[1]);           /* end of input: the shell exits */
+        close(outp[0]);
+        waitpid(pid, NULL, 0);
+    }
+    summary("prompt", t, n);
+    free(t);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: start_bench [-n count] [-o file] [shell [args...]]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *deftsh[] = { "./tsh", NULL }, **shell = deftsh;
+    char *argv2[MAXARGS + 3], *floor[] = { "/bin/true", NULL };
+    char *outfile = "start_output.txt";
+    int n = 1000, c, i, nargs;
+
+    while ((c = getopt(argc, argv, "+n:o:")) != -1) {
+        switch (c) {
+            case 'n': n = atoi(optarg); break;
+            case 'o': outfile = optarg; break;
+            default: usage();
+        }
+    }
+    if (n < 1)
+        usage();
+    if (optind < argc)
+        shell = argv + optind;
+    for (nargs = 0; shell[nargs] != NULL; nargs++)
+        if (nargs == MAXARGS)
+            usage();
+    if ((out = fopen(outfile, "we")) == NULL) {
+        perror(outfile);
+        return 1;
+    }
+
+    fprintf(out, "# start_bench:");
+    for (i = 0; i < nargs; i++)
+        fprintf(out, " %s", shell[i]);
+    fprintf(out, " (n %d)\n", n);
+
+    warmup = 1;                 /* fault the binaries into the page cache */
+    bench_exit("floor", floor, n / 10 + 1);
+    bench_exit("eof", shell, n / 10 + 1);
+    warmup = 0;
+
+    bench_exit("floor", floor, n);
+    bench_prompt(shell, n);
+    bench_exit("eof", shell, n);
+
+    memcpy(argv2, shell, nargs * sizeof(*argv2));
+    argv2[nargs] = "-c";
+    argv2[nargs + 1] = "/bin/true";
+    argv2[nargs + 2] = NULL;
+    bench_exit("oneshot", argv2, n);
+    argv2[nargs + 1] = "/bin/true; /bin/true";
+    bench_exit("list", argv2, n);
+
+    fclose(out);
+    return 0;
+}
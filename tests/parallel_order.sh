@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# parallel_order.sh - Output the shell buffered before parallel starts
+#    its jobs must come out ahead of theirs
+#
+#    gcc -O2 -o tsh tsh.c
+#    sh tests/parallel_order.sh [shell]
+#
+# The shell defaults to ./tsh. The argument lines of parallel come
+# from the shell's own input, through a pipe, so nothing blocks between
+# the jobs listing and the first echo. Runs with poll() and with -U.
+# Exits 1 on the first failure.
+
+tsh=${1:-./tsh}
+
+for flags in "" -U; do
+    out=$(printf 'sleep 1 &\njobs\nparallel -j 1 echo\nq1\nq2\n' | "$tsh" -p $flags | cat)
+    want=$(printf '%s\n' "$out" | sed -n '1s/^\[1\] ([0-9]*) sleep 1 &$/a/p
+2s/^\[1\] ([0-9]*) Running sleep 1 &$/b/p
+3s/^q1$/c/p
+4s/^q2$/d/p' | tr -d '\n')
+    if [ "$want" != abcd ]; then
+        echo "FAIL: tsh -p $flags:"
+        echo "$out"
+        exit 1
+    fi
+done
+echo "ok"
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# path_dir.sh - A directory on PATH must not hide the command behind it
+#
+#    gcc -O2 -o tsh tsh.c
+#    sh tests/path_dir.sh [shell]
+#
+# The shell defaults to ./tsh. It runs "ls -d /" with a directory
+# named ls first on PATH, both with posix_spawn and with -F, and once
+# more after the lookup has been hashed. Exits 1 on the first failure.
+
+tsh=${1:-./tsh}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/ls"
+
+for flags in "" -F; do
+    out=$(PATH="$dir:$PATH" "$tsh" $flags -c 'ls -d /; ls -d /' 2>&1)
+    if [ "$out" != "$(printf '/\n/')" ]; then
+        echo "FAIL: tsh $flags: $out"
+        exit 1
+    fi
+done
+echo "ok"
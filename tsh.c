@@ -2,6 +2,7 @@
  * A tiny shell program with job control
  * 
  */
+#define _GNU_SOURCE /* splice, memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,14 +10,118 @@
 #include <ctype.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL  /* clone3(): start in args.cgroup */
+#endif
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT   0  /* set_mempolicy(): allocate on the local node */
+#define MPOL_PREFERRED 1  /* set_mempolicy(): allocate on the given node first */
+#endif
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define INITJOBS     16   /* initial capacity of the job table */
+#define HASHSIZE     64   /* buckets in the command hash table */
+#define PCACHESIZE 1024   /* buckets in the parse cache */
+#define PCACHEMEM (1 << 20) /* bytes the parse cache may hold */
+#define ARENABLOCK 16384  /* bytes carved at a time by the job arena */
+#define ARENACLASSES 48   /* size classes of the job arena, 16 << k bytes */
+#define INBUFSIZE  4096   /* initial input buffer for a terminal */
+#define SCRIPTBUF 65536   /* input buffer in script mode */
+#define OUTBUFSIZE 65536  /* ring holding the shell's output, a power of two */
+#define ZYGOTEMSG 65536   /* largest command handed to a pool worker */
+#define ZYGOTEFDS    16   /* most descriptors handed to a pool worker */
+#define BUILTINHASH  32   /* slots in the builtin index, more than the builtins */
+#define NOTEBATCH    10   /* more job exits than this are reported as counts */
+#define CGNAME       48   /* room for the name of a job's cgroup */
+#define MAXCPUS    1024   /* CPUs and NUMA nodes the placer knows of */
+#define HISTSUB      16   /* histogram buckets per power of two */
+#define HISTBUCKETS (61 * HISTSUB) /* enough for any 64-bit value */
+#define SCANPAD      64   /* readable bytes kept past the NUL for the stop scanner */
+#define SCANMIN     256   /* shortest line worth scanning for stops */
+#define SCANRUN       8   /* mean plain run at which stop lookups pay off */
+#define HISTTAIL  65536   /* bytes of history searched linearly before it is indexed */
+#define CAPTURESIZE (1 << 20) /* bytes of a captured job's output kept for logs */
+#define CAPTICK      10   /* ms between trims of the logs while captured jobs run */
+#define REMOTEPID (1 << 30) /* pids of remote jobs, above any real one (PID_MAX_LIMIT) */
+#define REMOTEMSG 65536   /* largest payload of a message to or from an agent */
+#define KEYMIN       16   /* shortest key a TCP agent accepts (-k) */
+#define KEYMAX      256   /* ... and the longest */
+#define AUTHWAIT   5000   /* ms to wait for an agent to take the key */
+
+/* Vector stop scanners, picked at run time */
+#if defined(__x86_64__) || defined(__SSE2__)
+#define HAVE_SSE2 1
+#else
+#define HAVE_SSE2 0
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AVX2 1       /* built with target("avx2"), used if the CPU has it */
+#else
+#define HAVE_AVX2 0
+#endif
+#if defined(__aarch64__)
+#define HAVE_NEON 1
+#else
+#define HAVE_NEON 0
+#endif
+
+/* Signals consumed by the event loop instead of by handlers */
+#if defined(__linux__) && !defined(TSH_NO_SIGNALFD)
+#define USE_SIGNALFD 1    /* read them from a signalfd */
+#else
+#define USE_SIGNALFD 0    /* handlers forward them through a self-pipe */
+#endif
+
+/* Per-child pidfds (-P) */
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define HAVE_PIDFD 1
+#else
+#define HAVE_PIDFD 0
+#endif
+
+/* io_uring event loop (-U), through the raw system calls */
+#if defined(__linux__) && defined(SYS_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+#endif
+#ifndef HAVE_URING
+#define HAVE_URING 0
+#endif
+#define URING_OP_WAITID 50  /* IORING_OP_WAITID (6.7), not in every header */
+#define URINGDEPTH       8  /* submission slots; at most four are ever in use */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -28,40 +133,645 @@
 extern char **environ;      
 char prompt[] = "tsh> ";    
 int verbose = 0;            
+int use_fork = 0;            /* if true, start jobs with fork() (-F) */
+int use_pidfd = 0;           /* if true, track each job with a pidfd (-P) */
+int use_uring = 0;           /* if true, wait on an io_uring instead of poll() (-U) */
+int use_splice = 0;          /* if true, splice builtin output into pipelines (-S) */
+int stdio_moved = 0;         /* a builtin is running with stdio redirected */
+int notify_now = 0;          /* if true, report background jobs at once (-b) */
+int last_status = 0;         /* exit status of the last command, the shell's own at exit */
+int exec_tail = 0;           /* the line being run is the last input there is */
+int cg_root = -1;            /* directory of the cgroup given with -C, else -1 */
+char *cg_path = NULL;        /* its path */
+int cg_seq = 0;              /* job cgroups made so far */
+char cg_cpu[32] = "";        /* cpu.max and memory.max for new jobs, "" to leave */
+char cg_mem[32] = "";
+char *place_policy = NULL;   /* how background jobs are placed (-a), NULL if not */
+char *hist_path = NULL;      /* history file given with -H */
+char *key_path = NULL;       /* key file of TCP agents given with -k */
 char sbuf[MAXLINE];         
 
+/* Redirection operators */
+#define R_IN     0  /* n< path   */
+#define R_OUT    1  /* n> path   */
+#define R_APPEND 2  /* n>> path  */
+#define R_DUP    3  /* n>&m      */
+
+struct redir_t {             /* one redirection of a command */
+    int op;                  /* R_IN, R_OUT, R_APPEND or R_DUP */
+    int fd;                  /* descriptor being redirected */
+    int dupfd;               /* m of n>&m */
+    char *path;              /* file for the other operators */
+    int ofd;                 /* the opened file, -1 when not open */
+};
+
+struct cmd_t {               /* one stage of a pipeline */
+    char **argv;
+    struct redir_t *redirs;  /* applied in order, after the pipe ends */
+    int nredirs;
+};
+
+struct pipeline_t {          /* cmds[0] | cmds[1] | ... */
+    int ncmds;
+    struct cmd_t *cmds;
+    int bg;                  /* ended by & */
+    int timed;               /* prefixed with the time keyword */
+    int captured;            /* prefixed with the capture keyword */
+    int start, end;          /* its text in the command line */
+    char *node;              /* prefixed with @node: run it there, else NULL */
+    int body, bodyend;       /* with a node, the text sent to it, from start */
+};
+
+/* Token types; redirection operators are tokens of their R_* type */
+#define TK_WORD  4
+#define TK_PIPE  5  /* |  */
+#define TK_AMP   6  /* &  */
+#define TK_SEMI  7  /* ;  */
+
+struct token_t {             /* one token, a span of the command line */
+    int type;                /* TK_* or R_* */
+    int fd;                  /* n of n< and n>, -1 if not given */
+    char *s;                 /* a word's text after quote removal */
+    int len;                 /* length of s */
+    int start, end;          /* source span */
+};
+
+/* Character classes of the tokenizer */
+#define CC_PLAIN 0  /* part of a word */
+#define CC_DELIM 1  /* NUL, blank or operator: ends a word */
+#define CC_QUOTE 2  /* ' " or \ */
+
+static const unsigned char charclass[256] = {
+    ['\0'] = CC_DELIM, [' '] = CC_DELIM, ['\t'] = CC_DELIM,
+    ['|'] = CC_DELIM, ['&'] = CC_DELIM, [';'] = CC_DELIM,
+    ['<'] = CC_DELIM, ['>'] = CC_DELIM,
+    ['\''] = CC_QUOTE, ['"'] = CC_QUOTE, ['\\'] = CC_QUOTE,
+};
+
+struct parse_t {             /* workspace for parseline(), reused from line to line */
+    char *text; int textcap; /* the line, tokenized in place */
+    uint64_t *stops; int stopcap;  /* bit i set if text[i] is not CC_PLAIN */
+    struct token_t *toks; int ntoks, tokcap;
+    char **argv; int argvcap;
+    struct cmd_t *cmds; int cmdcap;
+    struct redir_t *redirs; int redircap;
+    struct pipeline_t *pipes; int pipecap;
+};
+
+/* Process states */
+#define PS_RUN  0 /* running */
+#define PS_STOP 1 /* stopped */
+#define PS_DONE 2 /* reaped */
+
+struct proc_t {              /* one process of a job */
+    pid_t pid;
+    int pidfd;               /* pidfd of the process with -P, else -1 */
+    int state;               /* PS_RUN, PS_STOP or PS_DONE */
+};
+
 struct job_t {              
-    pid_t pid;              
+    pid_t pid;               /* pid of the first process, the group leader */
     int jid;                
     int state;              
-    char cmdline[MAXLINE];  
+    char *cmdline;           /* command line text, owned by the job arena */
+    struct proc_t *procs;    /* pipeline processes, owned by the job arena */
+    int nprocs;              /* processes started */
+    int nlive;               /* processes not reaped yet */
+    int code, value;         /* CLD_* status of the last process */
+    int flags;               /* JOB_* */
+    struct timespec tstart;  /* before the first process was started */
+    struct timespec texec;   /* once the last started one had exec'd */
+    struct rusage ru;        /* summed over the processes reaped so far */
+    int cgseq;               /* its cgroup leaf with -C, 0 if it has none */
+    int cgfd;                /* directory of that leaf */
+    int cpu, node;           /* with JOB_PLACED: its CPU (-1 for a whole node) and NUMA node */
+    const struct executor_t *ex; /* what started it, and signals it */
 };
-struct job_t jobs[MAXJOBS]; 
+
+struct executor_t {          /* a place jobs run: here, or on an agent */
+    const char *name;
+    pid_t (*start)(struct pipeline_t *pl, int bg, char *cmdline); /* group leader, 0 if none */
+    int (*signal)(struct job_t *job, int sig);                     /* -1 with errno on failure */
+};
+
+/* Job flags */
+#define JOB_QUIET  1 /* started by a builtin: only report failures */
+#define JOB_TIMED  2 /* report its times when done (time keyword) */
+#define JOB_PLACED 4 /* pinned by the -a policy */
+#define JOB_WATCH  8 /* its end is left in exits[] instead of reported */
+#define JOB_CAPTURED 16 /* its output goes to a capture_t */
+struct jobtab_t {            /* growable job table */
+    struct job_t *slots;     /* the job with JID j lives in slots[j-1] */
+    int cap;                 /* number of slots */
+    struct pident_t {
+        pid_t pid;
+        int slot;            /* job slot of pid, -1 if the entry is empty */
+    } *pidmap;               /* open-addressed index of live process pids */
+    int pidcap;              /* size of pidmap, a power of two */
+    int npids;               /* entries in use */
+    uint64_t *freemap;       /* one bit per slot, set when the slot is free */
+    int fgslot;              /* slot of the foreground job, -1 if none */
+};
+struct jobtab_t jobs[1];     /* array of one so jobs can be passed as a pointer */
+
+struct arena_t {             /* size-class allocator for job data */
+    void *freelist[ARENACLASSES];  /* released chunks, linked through their first word */
+    char *next, *end;        /* unused part of the current block */
+};
+struct arena_t jobarena;
 
 volatile sig_atomic_t ready; 
+int interrupted = 0;         /* ctrl-c arrived with no foreground job */
+
+sigset_t shell_mask;         /* signal mask tsh started with; children get it back */
+int sig_fd = -1;             /* signalfd, or read end of the self-pipe */
+int sigpipe_w = -1;          /* write end of the self-pipe */
+
+struct reader_t {            /* line reader over a raw fd or a mapped file */
+    int fd;
+    char *buf;               /* read buffer, or the mapped file */
+    size_t cap;              /* size of buf, always > end */
+    size_t start, end;       /* unread bytes are buf[start..end) */
+    size_t scan;             /* buf[start..scan) has no newline */
+    int eof;                 /* no more bytes beyond end */
+};
+struct reader_t input;
+
+struct cmdhash_t {          /* command name -> absolute path */
+    char *name;
+    char *path;
+    int hits;               /* times the cached path was used */
+    struct cmdhash_t *next;
+};
+struct cmdhash_t *cmdhash[HASHSIZE];
+char *hashed_path = NULL;   /* value of $PATH the table was filled from */
+
+struct pcache_t {           /* a parsed command line, in one allocation */
+    unsigned int hash;      /* strhash() of line */
+    char *line;             /* the raw command line */
+    struct pipeline_t *pipes;
+    int npipes;
+    size_t size;            /* bytes of the allocation */
+    int busy;               /* being run; not to be evicted */
+    struct pcache_t *next;  /* hash chain */
+    struct pcache_t *newer, *older;  /* LRU list */
+};
+struct hist_t {             /* log-linear histogram, HDR style */
+    uint64_t count, sum, max;
+    uint64_t bucket[HISTBUCKETS];  /* values kept to 1/HISTSUB of themselves */
+};
+
+struct note_t {             /* a job state change not reported yet */
+    int jid;
+    pid_t pid;
+    int code;               /* CLD_EXITED, CLD_KILLED, CLD_STOPPED or CLD_CONTINUED */
+    int value;              /* exit status or signal number */
+};
+struct note_t *notes = NULL; /* queued for the next prompt */
+int nnotes = 0, notecap = 0;
+
+struct jobexit_t {          /* how a JOB_WATCH job ended */
+    pid_t pid;              /* its group leader */
+    int code;               /* CLD_EXITED or CLD_KILLED */
+    int value;              /* exit status or signal number */
+};
+struct jobexit_t *exits = NULL; /* for the builtin that started them */
+int nexits = 0, exitcap = 0;
+
+/* States of a dag target */
+#define DN_WAIT    0 /* for its deps, or queued to start */
+#define DN_RUN     1 /* its job is running */
+#define DN_DONE    2 /* succeeded */
+#define DN_FAILED  3 /* failed, retries and all */
+#define DN_SKIPPED 4 /* something it needs failed */
+
+struct dagnode_t {          /* one target of a dag file */
+    char *text;             /* copy of its line, which the strings point into */
+    char *name;
+    char *depnames;         /* until they are resolved into deps */
+    char *cmd;              /* command line, NULL if it only groups its deps */
+    int *deps, ndeps, depcap;    /* targets it needs */
+    int *users, nusers, usercap; /* targets that need it */
+    int needed;             /* part of this run */
+    int waiting;            /* deps not done yet */
+    int state;              /* DN_* */
+    int tries;              /* times its command was started */
+    pid_t pid;              /* its job while it runs */
+    int line;               /* in the file */
+    int chain;              /* next target in its hash bucket, -1 at the end */
+};
+
+struct dag_t {              /* a dag file being run */
+    const char *file;
+    struct dagnode_t *nodes;
+    int n, cap;
+    int *bucket, nbuckets;  /* name -> target hash, chained through nodes */
+    int *queue;             /* ring of targets ready to start, n long */
+    int qhead, qtail;
+    int nneeded, ndone, nfailed, nskipped;
+    int retries;            /* extra runs of a failing command */
+    int stop;               /* interrupted: start nothing more */
+};
+
+struct histfile_t {         /* the command history, one line per entry */
+    int fd;                 /* opened for appending, -1 if there is no history */
+    const char *map;        /* the file mapped read-only, NULL until first searched */
+    size_t maplen;          /* bytes mapped, more than the file to leave room to grow */
+    size_t size;            /* bytes of whole lines seen in the file */
+    uint64_t *index;        /* offsets of the entries in [0, indexed), sorted by text */
+    uint64_t *newest;       /* segment tree of the largest offset over index[] ranges */
+    size_t nindex;
+    size_t indexed;         /* bytes of the file covered by index[] */
+    char *last;             /* the line this shell read last, for !! */
+};
+struct histfile_t histfile = { .fd = -1 };
+
+struct capture_t {          /* output of a job started with capture */
+    int jid;                /* of the job, kept after it is gone */
+    pid_t pid;
+    char *cmdline;
+    int fd;                 /* memfd the job's stdout and stderr append to */
+    off_t start;            /* the bytes before it have been punched out */
+};
+struct capture_t *captures = NULL; /* one per jid at most, until it is reused */
+int ncaptures = 0, capturecap = 0;
+
+/* Messages between a shell and an agent (-A) */
+#define FR_RUN    'r'       /* shell: run the text under sh -c */
+#define FR_SIGNAL 'k'       /* shell: send the job's group a signal */
+#define FR_OUT    'o'       /* agent: bytes the job wrote to stdout */
+#define FR_ERR    'e'       /* agent: ... and to stderr */
+#define FR_STATUS 's'       /* agent: it exited, was killed, stopped or continued */
+#define FR_AUTH   'a'       /* shell: the key, first on TCP; agent: it was taken */
+
+struct frame_t {            /* header of a message, in network byte order */
+    uint32_t id;            /* the job, by its pid in the shell */
+    uint32_t len;           /* bytes of payload that follow, at most REMOTEMSG */
+    uint8_t type;           /* FR_* */
+    uint8_t pad[3];
+};
+
+struct node_t {             /* an agent that jobs are sent to with @name */
+    char *name;
+    char *addr;             /* socket path or host:port it listens on */
+    int fd;                 /* one connection for all of its jobs, -1 if none */
+    char *in;               /* bytes read that are not a whole message yet */
+    size_t inlen;
+};
+struct node_t *nodes = NULL;
+int nnodes = 0, nodecap = 0;
+
+struct rproc_t {            /* a job running on a node */
+    pid_t pid;              /* stands for it here, REMOTEPID and up */
+    int node;
+    int out;                /* its capture, or -1 for the shell's output */
+};
+struct rproc_t *rprocs = NULL;
+int nrprocs = 0, rproccap = 0;
+pid_t remote_next = REMOTEPID;
+
+struct builtin_t {          /* a builtin command */
+    const char *name;
+    void (*fn)(char **argv);
+};
+
+struct zygote_t {           /* forked worker waiting to exec a command (-Z) */
+    pid_t pid;              /* leads its own process group until used */
+    int sock;               /* our end of its socketpair */
+};
+struct zygote_t *pool = NULL; /* idle workers, kept apart from the jobs */
+int poolsize = 0;           /* workers to keep ready */
+int npool = 0;              /* workers ready now */
+
+struct cpuset_t {           /* a set of CPUs or of NUMA nodes */
+    uint64_t bits[MAXCPUS / 64];
+};
+
+/* Placement policies (-a) */
+#define PL_NONE 0 /* jobs share the shell's affinity */
+#define PL_RR   1 /* one CPU per job, the CPUs in turn */
+#define PL_PACK 2 /* one CPU per job, filling one node before the next */
+#define PL_NODE 3 /* a whole node per job, the least loaded one */
+
+struct placer_t {           /* where background jobs go (-a) */
+    int policy;             /* PL_* */
+    struct cpuset_t own;    /* the shell's affinity: the CPUs jobs may use */
+    struct pcpu_t {
+        int cpu;
+        int node;           /* index in nodes[] */
+        int load;           /* placed jobs on it */
+    } *cpus;
+    int ncpus;
+    struct pnode_t {
+        int node;
+        struct cpuset_t cpus; /* the usable ones */
+        int load;
+    } *nodes;
+    int nnodes;
+    int next;               /* index in cpus[] of the next PL_RR job */
+    int held;               /* the shell runs with a job's placement */
+    struct cpuset_t cur;    /* that placement */
+    int curnode;            /* its preferred memory node, or -1 */
+};
+struct placer_t placer;
+
+struct zreq_t {             /* a command for a worker; strings follow */
+    sigset_t mask;          /* signal mask to exec with */
+    int argc;
+    int cached;             /* path came from the command hash */
+    int nops;
+    int cgroup;             /* index of the passed cgroup directory, or -1 */
+    int placed;             /* run on cpus, memory from node if not -1 */
+    struct cpuset_t cpus;
+    int node;
+    struct {
+        int from;           /* an fd of the worker, or -1 - index of a passed fd */
+        int to;
+    } ops[ZYGOTEFDS];       /* dup2()s, in order */
+};
+
+#if HAVE_URING
+/* Requests on the ring, by their user_data */
+#define UR_WAITID 1 /* a child changed state */
+#define UR_SIGNAL 2 /* a signal arrived on sig_fd */
+#define UR_WRITE  3 /* output written from the output ring */
+#define UR_READ   4 /* input read for readline_fd() */
+
+struct uring_t {            /* the io_uring wait_events() sleeps on (-U) */
+    int fd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;        /* entries not handed to the kernel yet */
+    int waitid;             /* waiting for a child: 1 armed, 2 completed */
+    int waitres;
+    siginfo_t si;           /* the child, left to wait4() by WNOWAIT */
+    int sigread;            /* reading sig_fd: 1 armed, 2 completed */
+    int sigres;
+#if USE_SIGNALFD
+    struct signalfd_siginfo ssi;
+#else
+    unsigned char sigbyte;
+#endif
+    unsigned int writing;   /* bytes of output being written, 0 if none */
+    int reading;            /* a readline_fd() read is in flight */
+    int readres;
+} ring;
+#endif
+
+struct outbuf_t {           /* single-producer, single-consumer byte ring */
+    char buf[OUTBUFSIZE];
+    unsigned int head;      /* next byte to write(2), moved by outflush() */
+    unsigned int tail;      /* next byte to fill, moved by the producers */
+} outq;
+
+#if !USE_SIGNALFD
+#define EVQSIZE 256         /* events the relay handler can queue, a power of 2 */
+
+struct event_t {            /* a signal as the relay handler took it */
+    int sig;
+    pid_t pid;              /* SIGCHLD: the child, 0 once forgotten */
+    int code, value;        /* its CLD_* code and exit status or signal */
+    int hasru;              /* ru is set (not for stops collected with -P) */
+    struct rusage ru;
+    uint64_t ns;            /* when the handler ran */
+};
+
+struct evq_t {              /* single-producer, single-consumer event ring */
+    struct event_t ev[EVQSIZE];
+    unsigned int head;      /* next event to dispatch, moved by evq_drain() */
+    unsigned int tail;      /* next slot to fill, moved by sigrelay_handler() */
+    unsigned int sigchld;   /* SIGCHLDs taken, counted by the handler */
+    volatile sig_atomic_t overflow; /* the ring filled, children are left waiting */
+} evq;
+#endif
+
+struct stats_t {            /* counters for the stats builtin */
+    uint64_t evals;         /* command lines evaluated */
+    uint64_t builtins;      /* builtin commands run */
+    uint64_t spawns;        /* processes started */
+    uint64_t spawnfails;    /* processes that could not be started */
+    uint64_t pooled;        /* processes started by a pool worker */
+    uint64_t sigchld;       /* SIGCHLD deliveries */
+    uint64_t reaps;         /* processes reaped */
+    int jobs, jobsmax;      /* jobs in the table, high-water mark */
+    struct hist_t spawnlat; /* ns in spawn_job() per process */
+    struct hist_t waitfg;   /* ns blocked in waitfg() per foreground job */
+    struct hist_t sweep;    /* processes reaped per SIGCHLD (per poll with -P or the self-pipe) */
+    struct hist_t evdelay;  /* ns from a relay handler to dispatch (self-pipe build) */
+} stats;
+char *stats_file = NULL;    /* JSON goes here on SIGUSR2 and at exit (-s) */
+
+struct pcache_t *pcache[PCACHESIZE];
+struct pcache_t *pcache_mru, *pcache_lru;  /* ends of the LRU list */
+size_t pcache_bytes = 0;    /* held by all entries */
+unsigned long pcache_hits = 0, pcache_misses = 0, pcache_evictions = 0;
 
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
-void do_bgfg(char **argv);
+int isbuiltin(const char *name);
+const struct builtin_t *findbuiltin(const char *name);
+int tokenize(const char *cmdline, struct parse_t *ps);
+int optoken(char **rp);
+int isfdnum(const char *s, int len, int *fd);
+static inline int nextstop(const uint64_t *stops, int pos);
+int mapstops(struct parse_t *ps, int len);
+void scan_scalar(const char *text, int n, uint64_t *stops);
+#if HAVE_SSE2
+void scan_sse2(const char *text, int n, uint64_t *stops);
+#endif
+#if HAVE_AVX2
+void scan_avx2(const char *text, int n, uint64_t *stops);
+#endif
+#if HAVE_NEON
+void scan_neon(const char *text, int n, uint64_t *stops);
+#endif
+void scan_init(const char *text, int n, uint64_t *stops);
+extern void (*scanstops)(const char *text, int n, uint64_t *stops);
+extern int scan_force_scalar;
+int parseline(const char *cmdline, struct parse_t *ps);
+void *growarray(void *a, int *cap, int n, size_t size);
+void runpipeline(struct pipeline_t *pl, int bg, char *cmdline);
+pid_t startpipeline(struct pipeline_t *pl, int bg, char *cmdline);
+int openredirs(struct cmd_t *cmd);
+void closeredirs(struct cmd_t *cmd);
+void run_builtin(struct cmd_t *cmd, int outfd);
+void relay(int from, int to);
+pid_t spawn_job(struct cmd_t *cmd, const sigset_t *mask, pid_t pgid, int infd, int outfd, int cgfd);
+void execcmd(struct cmd_t *cmd);
+void execsimple(char *cmdline);
+int execable(const struct pipeline_t *pl);
+void do_quit(char **argv);
+void do_jobs(char **argv);
+void do_bg(char **argv);
+void do_fg(char **argv);
+void do_bgfg(char **argv, int state);
+void do_parallel(char **argv);
+void do_dag(char **argv);
+char *joinargs(char **argv);
 void waitfg(pid_t pid);
 void sigchld_handler(int sig);
 void sigint_handler(int sig);
 void sigtstp_handler(int sig);
+void sigrelay_handler(int sig);
+void initsignals(void);
+int wait_events(int infd, int timeout);
+void eventsig(int sig);
+void evq_drain(void);
+void evq_forget(pid_t pid);
+void reapchild(pid_t pid);
+void waitstatus(pid_t pid, int status, const struct rusage *ru);
+void reap_untracked(void);
+void reapexit(pid_t pid);
+int uring_init(void);
+int uring_wait(int timeout);
+ssize_t uring_read(int fd, void *buf, size_t n);
+void uring_reap(void);
+void uring_flushwait(void);
+void childstatus(pid_t pid, int code, int value, const struct rusage *ru);
+void reap_pidfd(int pidfd);
+void initreader(struct reader_t *r, int fd, size_t cap);
+int mapreader(struct reader_t *r, int fd);
+char *readline_fd(struct reader_t *r);
+int atend(struct reader_t *r);
 
-int parseline(const char *cmdline, char **argv); 
 void sigquit_handler(int sig);
 void sigusr1_handler(int sig);
 
+void *arena_alloc(struct arena_t *a, size_t n);
+void arena_free(struct arena_t *a, void *p, size_t n);
+char *arena_strdup(struct arena_t *a, const char *s);
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int freejid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void pidmap_rebuild(struct jobtab_t *jobs, int cap);
+void pidmap_insert(struct jobtab_t *jobs, pid_t pid, int i);
+void pidmap_remove(struct jobtab_t *jobs, pid_t pid);
+void growjobs(struct jobtab_t *jobs);
+void initjobs(struct jobtab_t *jobs);
+int freejid(struct jobtab_t *jobs); 
+int addjob(struct jobtab_t *jobs, pid_t pid, int state, char *cmdline);
+int addproc(struct jobtab_t *jobs, struct job_t *job, pid_t pid);
+void procdone(struct jobtab_t *jobs, struct job_t *job, int k);
+int deletejob(struct jobtab_t *jobs, pid_t pid); 
+void removejob(struct jobtab_t *jobs, struct job_t *job);
+void setjobstate(struct jobtab_t *jobs, struct job_t *job, int state);
+pid_t fgpid(struct jobtab_t *jobs);
+struct job_t *getjobpid(struct jobtab_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct jobtab_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct jobtab_t *jobs, int details);
+void notejob(struct job_t *job, int code, int value, int now);
+void printnote(const struct note_t *n);
+void reportnotes(void);
+double tsdiff(const struct timespec *a, const struct timespec *b);
+double tvsec(const struct timeval *tv);
+void addrusage(struct rusage *sum, const struct rusage *ru);
+void printtimes(double real, double user, double sys);
+
+unsigned int strhash(const char *s);
+char *path_search(const char *name);
+char *hash_lookup(const char *name, int *cached);
+void hash_forget(const char *name);
+void hash_clear(void);
+void do_hash(char **argv);
+
+struct pcache_t *pcache_lookup(const char *cmdline, unsigned int hash);
+struct pcache_t *pcache_store(const char *cmdline, unsigned int hash, struct parse_t *ps, int n);
+void pcache_unlink(struct pcache_t *pc);
+
+void pool_fill(void);
+pid_t pool_spawn(struct cmd_t *cmd, char *path, int cached, const sigset_t *mask,
+                 pid_t pgid, int infd, int outfd, int cgfd);
+int pool_reaped(pid_t pid, int code);
+void zygote(int sock);
+
+int dagfind(struct dag_t *d, const char *name);
+struct pipeline_t *dagcmd(struct dag_t *d, struct dagnode_t *node, struct parse_t *ps);
+int dagline(struct dag_t *d, const char *line, int lineno, struct parse_t *ps);
+int dagload(struct dag_t *d, const char *file, struct parse_t *ps);
+int dagplan(struct dag_t *d, char **targets);
+int dagskip(struct dag_t *d, int i);
+void dagdone(struct dag_t *d, int i, int code, int value);
+void dagfree(struct dag_t *d);
+
+void hist_open(const char *path);
+void hist_record(const char *line);
+int hist_sync(void);
+void hist_reindex(void);
+void hist_range(const char *s, size_t len, size_t *lo, size_t *hi);
+const char *hist_latest(const char *s, size_t len, size_t *n);
+char *hist_expand(char *line);
+void do_history(char **argv);
+
+int capopen(void);
+struct cmd_t *capcmd(struct cmd_t *cmd, int fd, int last);
+void capadd(struct job_t *job, int fd);
+struct capture_t *capfind(int jid);
+void captrim(void);
+int captick(int timeout);
+void capreport(const struct job_t *job);
+void do_logs(char **argv);
+int sendframe(int fd, uint32_t id, int type, const void *data, size_t len);
+int local_signal(struct job_t *job, int sig);
+int signaljob(struct job_t *job, int sig);
+const struct executor_t *pipeexec(const struct pipeline_t *pl);
+struct node_t *node_get(const char *name);
+struct node_t *node_add(const char *name, const char *addr);
+int node_connect(struct node_t *nd);
+void node_input(struct node_t *nd);
+void node_lost(struct node_t *nd);
+void node_frame(struct node_t *nd, const struct frame_t *fr, const char *data);
+struct rproc_t *rproc_find(pid_t pid);
+void rproc_done(struct rproc_t *rp);
+int hostport(const char *addr, char *buf, size_t size, char **host, char **port);
+int isunixaddr(const char *addr);
+int unixaddr(const char *path, struct sockaddr_un *sun);
+int unixstale(const struct sockaddr_un *sun);
+int peerok(int fd);
+int readkey(char *key);
+int keymatch(const char *key, size_t keylen, const char *s, size_t len);
+int node_auth(struct node_t *nd, int fd);
+pid_t remote_start(struct pipeline_t *pl, int bg, char *cmdline);
+int remote_signal(struct job_t *job, int sig);
+void do_remote(char **argv);
+void agent(const char *addr);
+void agent_sigchld(int sig);
+
+/* Where jobs run: pipeexec() picks one for each pipeline */
+const struct executor_t executors[] = {
+    { "local",  startpipeline, local_signal },  /* processes of the shell's own */
+    { "remote", remote_start,  remote_signal }, /* sh -c on the agent of an @node */
+};
+
+void cginit(const char *path);
+int cgnew(int *seq);
+void cgname(char *buf, int seq);
+void cgdone(int seq, int fd);
+int cgwrite(int dirfd, const char *file, const char *val);
+pid_t cgfork(int cgfd);
+void cgreport(int cgfd);
+void do_limit(char **argv);
+
+void placeinit(const char *policy);
+int placebegin(int *cpu, int *node);
+void placeend(void);
+void placedone(int cpu, int node);
+void placereport(const struct job_t *job);
+void setaffinity(const struct cpuset_t *set);
+void setmempolicy(int node);
+
+void outwrite(const char *s, size_t n);
+void outprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void outflush(void);
+
+static inline uint64_t nsnow(void);
+void histadd(struct hist_t *h, uint64_t v);
+uint64_t histpct(const struct hist_t *h, double q);
+void printhist(const char *name, const struct hist_t *h, const char *unit, double scale);
+void jsonhist(FILE *f, const char *name, const struct hist_t *h);
+void statsjson(FILE *f);
+void dumpstats(void);
+void do_stats(char **argv);
 
 void usage(void);
 void unix_error(char *msg);
@@ -74,14 +784,18 @@ handler_t *Signal(int signum, handler_t *handler);
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE];
-    int emit_prompt = 1; 
+    char *cmdline;
+    char *script = NULL;     /* file given with -f */
+    char *command = NULL;    /* command line given with -c */
+    char *agent_addr = NULL; /* socket path or host:port given with -A */
+    int fd, emit_prompt = 1; 
 
     
     dup2(STDOUT_FILENO, STDERR_FILENO);
+    atexit(outflush);
 
     
-    while ((c = getopt(argc, argv, "hvp")) != -1) {
+    while ((c = getopt(argc, argv, "hvpbFPSUc:f:s:Z:C:a:H:A:k:")) != -1) {
         switch (c) {
             case 'h':             
                 usage();
@@ -92,491 +806,5978 @@ int main(int argc, char **argv) {
             case 'p':             
                 emit_prompt = 0;  
                 break;
+            case 'b':             
+                notify_now = 1;
+                break;
+            case 'F':             
+                use_fork = 1;
+                break;
+            case 'P':             
+                use_pidfd = HAVE_PIDFD;
+                break;
+            case 'S':             
+                use_splice = 1;
+                break;
+            case 'U':             
+                use_uring = HAVE_URING;
+                break;
+            case 'c':             
+                command = optarg;
+                emit_prompt = 0;
+                break;
+            case 'f':             
+                script = optarg;
+                emit_prompt = 0;
+                break;
+            case 's':             
+                stats_file = optarg;
+                atexit(dumpstats);
+                break;
+            case 'C':             
+                cg_path = optarg;
+                break;
+            case 'a':             
+                place_policy = optarg;
+                break;
+            case 'H':             
+                hist_path = optarg;
+                break;
+            case 'A':             
+                agent_addr = optarg;
+                break;
+            case 'k':             
+                key_path = optarg;
+                break;
+            case 'Z':             
+                if ((poolsize = atoi(optarg)) < 0)
+                    poolsize = 0;
+                if ((pool = calloc(poolsize + 1, sizeof(*pool))) == NULL)
+                    unix_error("calloc error");
+                break;
             default:
                 usage();
         }
     }
 
-    
+    if (agent_addr != NULL)
+        agent(agent_addr);
+
+    // A one-shot command that is a single program needs none of the
+    // shell's own setup, so it is exec'd before any of it is done
+    if (command != NULL)
+        execsimple(command);
 
     Signal(SIGUSR1, sigusr1_handler);
 
     
-    Signal(SIGINT,  sigint_handler);   
-    Signal(SIGTSTP, sigtstp_handler);  
-    Signal(SIGCHLD, sigchld_handler); 
+    initsignals(); /* SIGINT, SIGTSTP and SIGCHLD go to the event loop */
+    if (use_uring && !uring_init()) {
+        if (verbose)
+            outprintf("io_uring with waitid is not available, using poll()\n");
+        use_uring = 0;
+    }
+    if (use_uring)
+        use_pidfd = 0; // Exits come from the ring instead
 
     
     Signal(SIGQUIT, sigquit_handler); 
 
    
     initjobs(jobs);
+    if (cg_path != NULL)
+        cginit(cg_path);
+    if (place_policy != NULL)
+        placeinit(place_policy);
+    if (hist_path != NULL || (script == NULL && command == NULL && isatty(STDIN_FILENO)))
+        hist_open(hist_path);
+
+    if (command != NULL) {
+        exec_tail = 1;
+        eval(command);
+        reportnotes();
+        exit(last_status);
+    }
+
+    
+    if (script != NULL) {
+        if ((fd = open(script, O_RDONLY | O_CLOEXEC)) < 0) {
+            outprintf("%s: %s\n", script, strerror(errno));
+            exit(1);
+        }
+        if (!mapreader(&input, fd))
+            initreader(&input, fd, SCRIPTBUF);
+    } else {
+        initreader(&input, STDIN_FILENO, isatty(STDIN_FILENO) ? INBUFSIZE : SCRIPTBUF);
+    }
 
     
     while (1) {
 
-        
-        if (emit_prompt) {
-            printf("%s", prompt);
-            fflush(stdout);
-        }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { 
-            fflush(stdout);
-            exit(0);
-        }
+        
+        // The prompt is written out when the reader blocks for input
+        reportnotes();
+        captrim();
+        if (emit_prompt)
+            outwrite(prompt, strlen(prompt));
+        if ((cmdline = readline_fd(&input)) == NULL) {
+            reportnotes();
+            exit(last_status);
+        }
+        if (histfile.fd >= 0) {
+            if ((cmdline = hist_expand(cmdline)) == NULL)
+                continue;
+            hist_record(cmdline);
+        }
+
+        // Without a prompt to show after it, the last line may end in an exec
+        exec_tail = !emit_prompt && atend(&input);
+        eval(cmdline);
+    } 
+
+    exit(0); 
+}
+/* 
+ * eval - Evaluate the command line that the user has just typed in
+ * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * then execute it immediately. Otherwise, start a child process for
+ * each stage of the pipeline and run the job in the context of the
+ * children. If the job is running in the foreground, wait for it to
+ * terminate and then return. Pipelines separated by ; or & are run in
+ * turn. A line seen before is not parsed again.
+*/
+void eval(char *cmdline) {
+    static struct parse_t ps; // Token and argv storage, kept between lines
+    struct pipeline_t *pipes, *pl;
+    struct pcache_t *pc;
+    unsigned int hash = strhash(cmdline);
+    char *text;
+    int i, n, len;
+
+    stats.evals++;
+    // Repeated lines are run from their cached parse
+    if ((pc = pcache_lookup(cmdline, hash)) == NULL) {
+        if ((n = parseline(cmdline, &ps)) <= 0)
+            return; // Empty line or syntax error
+        pc = pcache_store(cmdline, hash, &ps, n);
+    }
+    if (pc != NULL) {
+        pc->busy++;
+        pipes = pc->pipes;
+        n = pc->npipes;
+    } else {
+        pipes = ps.pipes;
+    }
+
+    for (i = 0; i < n; i++) {
+        pl = &pipes[i];
+        if (pl->ncmds == 1 && !pl->timed && pl->node == NULL && isbuiltin(pl->cmds[0].argv[0])) {
+            run_builtin(&pl->cmds[0], -1);
+            last_status = 0;
+            continue;
+        }
+        // The shell has nothing left to do after the last command
+        if (exec_tail && i == n - 1 && execable(pl)) {
+            reportnotes();
+            execcmd(&pl->cmds[0]);
+        }
+        // The job is known by its own part of the line
+        len = pl->end - pl->start;
+        if (n == 1 || (text = malloc(len + 1)) == NULL) {
+            runpipeline(pl, pl->bg, cmdline + pl->start);
+            continue;
+        }
+        memcpy(text, cmdline + pl->start, len);
+        text[len] = '\0';
+        runpipeline(pl, pl->bg, text);
+        free(text);
+    }
+    if (pc != NULL)
+        pc->busy--;
+}
+
+/*
+ * tokenize - Split cmdline into words and the operators | & ; < > >>
+ *    >& in a single pass. The line is copied once into ps->text and the
+ *    words are unquoted and terminated in place there: 'single quotes'
+ *    are literal, "double quotes" keep \" \\ \$ and \` as escapes, and
+ *    a backslash outside quotes takes the next character literally. A
+ *    run of digits directly before < or > is the fd of that operator.
+ *    On long lines of long words, the ends of plain runs are taken from
+ *    a bitmap built by a vector scanner instead of byte by byte.
+ *    Returns the number of tokens, or -1 after reporting an error.
+ */
+int tokenize(const char *cmdline, struct parse_t *ps) {
+    struct token_t *t, *toks = ps->toks;
+    char *r, *w, *e, *text, q;  /* read, write, run start */
+    int len = strlen(cmdline), ntoks = 0, quoted, fd, deferred = 0, usemap;
+
+    // The stop scanners read whole 64-byte blocks, past the NUL
+    ps->text = growarray(ps->text, &ps->textcap, len + 1 + SCANPAD, 1);
+    text = memcpy(ps->text, cmdline, len + 1);
+    usemap = !scan_force_scalar && len >= SCANMIN && mapstops(ps, len);
+
+    for (r = text; ; ) {
+        while (*r == ' ' || *r == '\t')
+            r++;
+        if (*r == '\0')
+            break;
+        // Counts are kept in locals: the stores through w may alias ps
+        if (ntoks == ps->tokcap)
+            ps->toks = toks = growarray(toks, &ps->tokcap, ntoks + 1, sizeof(struct token_t));
+        t = &toks[ntoks++];
+        t->start = r - text;
+        t->fd = -1;
+        t->s = NULL;
+        t->len = 0;
+        if (charclass[(unsigned char)*r] == CC_DELIM) {
+            t->type = optoken(&r);
+            t->end = r - text;
+            continue;
+        }
+
+        // A word: copy it down over its own quotes, but leave runs
+        // of plain characters in place until there is a gap to close
+        t->type = TK_WORD;
+        t->s = w = r;
+        quoted = 0;
+        for (;;) {
+            e = r;
+            if (usemap) {
+                r = text + nextstop(ps->stops, r - text);
+            } else {
+                while (charclass[(unsigned char)*r] == CC_PLAIN)
+                    r++;
+            }
+            if (w == e) {
+                w = r;
+            } else {
+                memmove(w, e, r - e);
+                w += r - e;
+            }
+            if (charclass[(unsigned char)*r] != CC_QUOTE)
+                break; // NUL, blank or operator
+            quoted = 1;
+            if (*r == '\\') {
+                if (*++r != '\0')
+                    *w++ = *r++;
+                continue;
+            }
+            for (q = *r++; *r != q; *w++ = *r++) {
+                if (*r == '\0') {
+                    outprintf("syntax error: unterminated %s quote\n",
+                           q == '"' ? "double" : "single");
+                    return ps->ntoks = -1;
+                }
+                if (q == '"' && *r == '\\' && r[1] != '\0' && strchr("\"\\$`", r[1]))
+                    r++;
+            }
+            r++;
+        }
+        t->len = w - t->s;
+
+        if (!quoted && (*r == '<' || *r == '>') && isfdnum(t->s, t->len, &fd)) {
+            // n< or n>: the number belongs to the operator
+            t->type = optoken(&r);
+            t->fd = fd;
+            t->s = NULL;
+            t->len = 0;
+        }
+        t->end = r - text;
+        if (t->type != TK_WORD) {
+            continue;
+        } else if (*r == '\0' || *r == ' ' || *r == '\t') {
+            r += *r != '\0';
+            *w = '\0'; // Even when w was r, that byte has been read
+        } else {
+            deferred = 1;
+        }
+    }
+
+    // A word that runs into an operator can only be terminated now:
+    // its NUL may land on the first byte of that operator
+    for (t = toks; deferred && t < toks + ntoks; t++) {
+        if (t->type == TK_WORD)
+            t->s[t->len] = '\0';
+    }
+    return ps->ntoks = ntoks;
+}
+
+/* isfdnum - Is s[0..len) all digits? Sets *fd to its value if so */
+int isfdnum(const char *s, int len, int *fd) {
+    int i;
+
+    for (*fd = i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)s[i]) || *fd > 1000000)
+            return 0;
+        *fd = *fd * 10 + (s[i] - '0');
+    }
+    return 1;
+}
+
+/* scanstops - Fill in the stop bitmap of the first n bytes of text */
+void (*scanstops)(const char *text, int n, uint64_t *stops) = scan_init;
+int scan_force_scalar = 0;   /* if true, tokenize() never uses the bitmap */
+
+/*
+ * nextstop - Return the position of the first byte at or after pos
+ *    that is not CC_PLAIN. There is always one: the NUL.
+ */
+static inline int nextstop(const uint64_t *stops, int pos) {
+    uint64_t bits = stops[pos >> 6] >> (pos & 63);
+
+    if (bits != 0)
+        return pos + __builtin_ctzll(bits);
+    for (pos = (pos | 63) + 1; (bits = stops[pos >> 6]) == 0; pos += 64)
+        ;
+    return pos + __builtin_ctzll(bits);
+}
+
+/*
+ * mapstops - Scan ps->text, a line of len bytes, into the stop bitmap.
+ *    Returns 1 if its plain runs are long enough on average for lookups
+ *    in the bitmap to beat stepping through them byte by byte. No
+ *    unread byte is ever overwritten while tokenizing, so the bitmap
+ *    holds for the whole line.
+ */
+int mapstops(struct parse_t *ps, int len) {
+    int i, n = len / 64 + 1, count = 0;
+
+    memset(ps->text + len + 1, 0, SCANPAD);
+    ps->stops = growarray(ps->stops, &ps->stopcap, n, sizeof(uint64_t));
+    scanstops(ps->text, len + 1, ps->stops);
+    for (i = 0; i < n; i++)
+        count += __builtin_popcountll(ps->stops[i]);
+    return len >= SCANRUN * count;
+}
+
+/*
+ * The stop scanners. Each sets bit i of stops for the bytes text[i],
+ * i < n, that end a plain run: the NUL, blanks, operators and quotes.
+ * The vector versions compare 64 bytes at a time against those eleven
+ * bytes, so they read up to SCANPAD bytes past n and may set bits for
+ * them; tokenize() keeps those bytes readable.
+ */
+void scan_scalar(const char *text, int n, uint64_t *stops) {
+    int i;
+
+    memset(stops, 0, (n + 63) / 64 * sizeof(uint64_t));
+    for (i = 0; i < n; i++) {
+        if (charclass[(unsigned char)text[i]] != CC_PLAIN)
+            stops[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+}
+
+#if HAVE_SSE2
+/* stops16_sse2 - Mask of the stop bytes of p[0..16) */
+static inline unsigned int stops16_sse2(const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    return _mm_movemask_epi8(hit);
+}
+
+void scan_sse2(const char *text, int n, uint64_t *stops) {
+    int i;
+
+    for (i = 0; i < n; i += 64) {
+        stops[i >> 6] = (uint64_t)stops16_sse2(text + i) |
+                        (uint64_t)stops16_sse2(text + i + 16) << 16 |
+                        (uint64_t)stops16_sse2(text + i + 32) << 32 |
+                        (uint64_t)stops16_sse2(text + i + 48) << 48;
+    }
+}
+#endif
+
+#if HAVE_AVX2
+/* stops32_avx2 - Mask of the stop bytes of p[0..32) */
+__attribute__((target("avx2")))
+static inline uint32_t stops32_avx2(const char *p) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hit = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+
+__attribute__((target("avx2")))
+void scan_avx2(const char *text, int n, uint64_t *stops) {
+    int i;
+
+    for (i = 0; i < n; i += 64)
+        stops[i >> 6] = (uint64_t)stops32_avx2(text + i) |
+                        (uint64_t)stops32_avx2(text + i + 32) << 32;
+}
+#endif
+
+#if HAVE_NEON
+/* stops16_neon - 0xff in each byte of p[0..16) that is a stop byte */
+static inline uint8x16_t stops16_neon(const char *p) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint8x16_t hit = vceqq_u8(v, vdupq_n_u8(0));
+
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(' ')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('\t')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('|')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('&')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(';')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('<')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('>')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('\'')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('"')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('\\')));
+    return hit;
+}
+
+void scan_neon(const char *text, int n, uint64_t *stops) {
+    static const uint8_t weight[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                        1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t w = vld1q_u8(weight), a, b;
+    int i;
+
+    // Weight each hit by its bit, then add neighbours down to 8 bytes
+    for (i = 0; i < n; i += 64) {
+        a = vpaddq_u8(vandq_u8(stops16_neon(text + i), w),
+                      vandq_u8(stops16_neon(text + i + 16), w));
+        b = vpaddq_u8(vandq_u8(stops16_neon(text + i + 32), w),
+                      vandq_u8(stops16_neon(text + i + 48), w));
+        a = vpaddq_u8(a, b);
+        a = vpaddq_u8(a, a);
+        stops[i >> 6] = vgetq_lane_u64(vreinterpretq_u64_u8(a), 0);
+    }
+}
+#endif
+
+/*
+ * scan_init - Point scanstops at the widest scanner this CPU runs,
+ *    then scan with it
+ */
+void scan_init(const char *text, int n, uint64_t *stops) {
+    scanstops = scan_scalar;
+#if HAVE_NEON
+    scanstops = scan_neon;
+#endif
+#if HAVE_SSE2
+    scanstops = scan_sse2;
+#endif
+#if HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanstops = scan_avx2;
+#endif
+    scanstops(text, n, stops);
+}
+
+/*
+ * optoken - If *rp points at an operator, step over it and return its
+ *    token type. Returns -1 otherwise.
+ */
+int optoken(char **rp) {
+    char *r = *rp;
+    int type;
+
+    switch (r[0]) {
+    case '|': type = TK_PIPE; break;
+    case '&': type = TK_AMP; break;
+    case ';': type = TK_SEMI; break;
+    case '<': type = R_IN; break;
+    case '>':
+        type = r[1] == '>' ? R_APPEND : r[1] == '&' ? R_DUP : R_OUT;
+        break;
+    default:
+        return -1;
+    }
+    *rp = r + (type == R_APPEND || type == R_DUP ? 2 : 1);
+    return type;
+}
+
+/*
+ * parseline - Tokenize cmdline and build its pipelines in ps: argv
+ *    arrays, stages and redirections of each, with ; or & between
+ *    pipelines. Nothing is limited but memory, and the storage is kept
+ *    in ps for the next line. Returns the number of pipelines, or -1
+ *    after reporting a syntax error.
+ */
+int parseline(const char *cmdline, struct parse_t *ps) {
+    static const char *opname[] = { "<", ">", ">>", ">&", NULL, "|", "&", ";" };
+    struct pipeline_t *pl;
+    struct token_t *t, *end;
+    struct cmd_t *cmd;
+    struct redir_t *r;
+    char **argv;
+    int ntoks;
+
+    if ((ntoks = tokenize(cmdline, ps)) <= 0)
+        return ntoks;
+
+    // Nothing can need more slots than there are tokens, and a stage is
+    // never longer than its own words plus a NULL
+    ps->argv = growarray(ps->argv, &ps->argvcap, 2 * ntoks + 1, sizeof(char *));
+    ps->cmds = growarray(ps->cmds, &ps->cmdcap, ntoks + 1, sizeof(struct cmd_t));
+    ps->redirs = growarray(ps->redirs, &ps->redircap, ntoks, sizeof(struct redir_t));
+    ps->pipes = growarray(ps->pipes, &ps->pipecap, ntoks + 1, sizeof(struct pipeline_t));
+    argv = ps->argv;
+    cmd = ps->cmds;
+    r = ps->redirs;
+    pl = ps->pipes;
+    end = ps->toks + ntoks;
+
+    for (t = ps->toks; t < end; pl++) {
+        pl->cmds = cmd;
+        pl->ncmds = 0;
+        pl->bg = 0;
+        pl->start = t->start;
+        // An unquoted time in front times the pipeline, capture keeps
+        // its output for logs and @node runs it on a remote agent; they
+        // may come in any order
+        pl->timed = pl->captured = 0;
+        pl->node = NULL;
+        while (t->type == TK_WORD && t + 1 < end && (t[1].type == TK_WORD || t[1].type <= R_DUP)) {
+            if (!pl->timed && t->end - t->start == 4 && strcmp(t->s, "time") == 0)
+                pl->timed = 1;
+            else if (!pl->captured && t->end - t->start == 7 && strcmp(t->s, "capture") == 0)
+                pl->captured = 1;
+            else if (pl->node == NULL && t->s[0] == '@' && t->len > 1 && t->end - t->start == t->len)
+                pl->node = t->s + 1;
+            else
+                break;
+            t++;
+        }
+        pl->body = t->start - pl->start;
+        for (;;) {
+            // One stage: words and redirections up to | ; & or the end
+            cmd->argv = argv;
+            cmd->redirs = r;
+            cmd->nredirs = 0;
+            for (; t < end && (t->type == TK_WORD || t->type <= R_DUP); t++) {
+                if (t->type == TK_WORD) {
+                    *argv++ = t->s;
+                    continue;
+                }
+                if (t + 1 == end || t[1].type != TK_WORD ||
+                    (t->type == R_DUP && (t[1].len != 1 || !isdigit((unsigned char)t[1].s[0])))) {
+                    outprintf("syntax error near unexpected token '%s'\n",
+                           t + 1 == end ? "newline" : t[1].type == TK_WORD ? t[1].s : opname[t[1].type]);
+                    return -1;
+                }
+                r->op = t->type;
+                r->fd = t->fd >= 0 ? t->fd : t->type == R_IN ? STDIN_FILENO : STDOUT_FILENO;
+                r->ofd = -1;
+                r->path = NULL;
+                if (t->type == R_DUP)
+                    r->dupfd = t[1].s[0] - '0';
+                else
+                    r->path = t[1].s;
+                r++;
+                cmd->nredirs++;
+                t++;
+            }
+            *argv++ = NULL;
+
+            if (cmd->argv[0] == NULL) {
+                if (cmd->nredirs == 0)
+                    outprintf("syntax error near unexpected token '%s'\n",
+                           t < end ? opname[t->type] : "newline");
+                else
+                    outprintf("syntax error: missing command\n");
+                return -1;
+            }
+            cmd++;
+            pl->ncmds++;
+            pl->end = t[-1].end;
+            pl->bodyend = pl->end - pl->start;
+            if (t == end || t->type != TK_PIPE)
+                break;
+            t++;
+            if (t == end) {
+                outprintf("syntax error near unexpected token 'newline'\n");
+                return -1;
+            }
+        }
+        if (t < end) {
+            // ; or &: the & is part of the background job's text
+            pl->bg = t->type == TK_AMP;
+            if (pl->bg)
+                pl->end = t->end;
+            t++;
+        }
+    }
+    return pl - ps->pipes;
+}
+
+/*
+ * growarray - Make room for at least n elements of size bytes in a,
+ *    doubling its capacity *cap as needed. Returns the new array.
+ */
+void *growarray(void *a, int *cap, int n, size_t size) {
+    int newcap = *cap > 0 ? *cap : 16;
+
+    if (n <= *cap)
+        return a;
+    while (newcap < n)
+        newcap *= 2;
+    if ((a = realloc(a, (size_t)newcap * size)) == NULL)
+        unix_error("growarray: realloc error");
+    *cap = newcap;
+    return a;
+}
+
+/*
+ * runpipeline - Run pl as a job, waiting for it in the foreground or
+ *    announcing it in the background
+ */
+void runpipeline(struct pipeline_t *pl, int bg, char *cmdline) {
+    pid_t pgid;
+
+    last_status = 0;
+    if ((pgid = pipeexec(pl)->start(pl, bg, cmdline)) == 0)
+        return;
+    if (!bg) {
+        waitfg(pgid); // Wait for foreground job to finish
+    } else {
+        outprintf("[%d] (%d) %s\n", pid2jid(pgid), pgid, cmdline); // Print background job
+    }
+}
+
+/*
+ * startpipeline - Start every stage of pl as one job in a single
+ *    process group, connected by pipes. Builtin stages run inside the
+ *    shell, after the external stages have been started so that
+ *    whatever reads their output is already running. Returns the pid
+ *    of the job's group leader, or 0 if no process was started.
+ */
+pid_t startpipeline(struct pipeline_t *pl, int bg, char *cmdline) {
+    int bout[pl->ncmds];    // Pipe write end of each builtin stage
+    struct cmd_t *cmd;
+    int fds[2], in = -1, out, i;
+    struct job_t *job = NULL;
+    struct timespec t0, t1;
+    struct rusage self0, self1;
+    pid_t pid, pgid = 0;
+    int cgseq = 0, cgfd = cg_root >= 0 ? cgnew(&cgseq) : -1;
+    int placed, cpu, node, capfd;
+
+    // Job boundary: collect finished jobs and get our output out
+    // before the children start writing to the same descriptors
+    wait_events(-1, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pl->timed)
+        getrusage(RUSAGE_SELF, &self0);
+
+    capfd = pl->captured ? capopen() : -1;
+    // Every process of a background job goes where the policy puts it
+    placed = bg && placebegin(&cpu, &node);
+    for (i = 0; i < pl->ncmds; i++) {
+        out = -1;
+        if (i < pl->ncmds - 1) {
+            if (pipe2(fds, O_CLOEXEC) < 0)
+                unix_error("pipe error");
+            out = fds[1];
+        }
+
+        bout[i] = -2;
+        if (isbuiltin(pl->cmds[i].argv[0])) {
+            bout[i] = out; // Runs once the readers are up
+        } else if (openredirs(&pl->cmds[i]) == 0) {
+            cmd = capfd >= 0 ? capcmd(&pl->cmds[i], capfd, i == pl->ncmds - 1) : &pl->cmds[i];
+            if ((pid = spawn_job(cmd, &shell_mask, pgid, in, out, cgfd)) != 0) {
+                if (job == NULL) {
+                    addjob(jobs, pid, bg ? BG : FG, cmdline); // Add the job to the job list
+                    job = getjobpid(jobs, pid);
+                    job->cgseq = cgseq;
+                    job->cgfd = cgfd;
+                    if (placed) {
+                        job->flags |= JOB_PLACED;
+                        job->cpu = cpu;
+                        job->node = node;
+                    }
+                    job->tstart = t0;
+                    if (pl->timed)
+                        job->flags |= JOB_TIMED;
+                    pgid = pid;
+                } else {
+                    addproc(jobs, job, pid);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &job->texec); // It has exec'd
+            }
+            closeredirs(&pl->cmds[i]);
+        }
+
+        if (in >= 0)
+            close(in);
+        if (out >= 0 && bout[i] == -2)
+            close(out);
+        in = out >= 0 ? fds[0] : -1;
+    }
+    placeend();
+
+    for (i = 0; i < pl->ncmds; i++) {
+        if (bout[i] != -2) {
+            run_builtin(&pl->cmds[i], bout[i]);
+            if (bout[i] >= 0)
+                close(bout[i]);
+        }
+    }
+
+    if (capfd >= 0 && job != NULL) {
+        job->flags |= JOB_CAPTURED;
+        capadd(job, capfd);
+    } else if (capfd >= 0) {
+        close(capfd);
+    }
+    if (job == NULL) { // Nothing was started
+        if (cgfd >= 0)
+            cgdone(cgseq, cgfd);
+        if (placed)
+            placedone(cpu, node);
+        if (pl->timed) {
+            // Only builtins ran, in the shell itself
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            getrusage(RUSAGE_SELF, &self1);
+            printtimes(tsdiff(&t0, &t1), tvsec(&self1.ru_utime) - tvsec(&self0.ru_utime),
+                       tvsec(&self1.ru_stime) - tvsec(&self0.ru_stime));
+        }
+    }
+    return pgid;
+}
+
+/*
+ * openredirs - Open the files named by the redirections of cmd, close
+ *    on exec so they only survive where they are dup2()ed. Returns -1
+ *    (with nothing left open) if one of them can't be opened.
+ */
+int openredirs(struct cmd_t *cmd) {
+    struct redir_t *r;
+    int flags;
+
+    for (r = cmd->redirs; r < cmd->redirs + cmd->nredirs; r++) {
+        if (r->op == R_DUP)
+            continue;
+        if (r->op == R_IN)
+            flags = O_RDONLY;
+        else if (r->op == R_APPEND)
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+        else
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if ((r->ofd = open(r->path, flags | O_CLOEXEC, 0666)) < 0) {
+            outprintf("%s: %s\n", r->path, strerror(errno));
+            closeredirs(cmd);
+            last_status = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* closeredirs - Close the files opened by openredirs() */
+void closeredirs(struct cmd_t *cmd) {
+    struct redir_t *r;
+
+    for (r = cmd->redirs; r < cmd->redirs + cmd->nredirs; r++) {
+        if (r->ofd >= 0)
+            close(r->ofd);
+        r->ofd = -1;
+    }
+}
+
+/*
+ * run_builtin - Run a builtin inside the shell with its stdout on
+ *    outfd (-1 leaves it alone) and its redirections applied, putting
+ *    the shell's own descriptors back afterwards. With -S pipeline
+ *    output is staged in a memfd and spliced into the pipe afterwards,
+ *    so the bytes are moved as page references instead of being
+ *    copied through a user buffer a second time.
+ */
+void run_builtin(struct cmd_t *cmd, int outfd) {
+    int saved[3] = { -1, -1, -1 }; // Shell copies of fds 0-2
+    int stage = outfd, fd, i;
+    struct redir_t *r;
+
+    stats.builtins++;
+    if (outfd < 0 && cmd->nredirs == 0) {
+        builtin_cmd(cmd->argv);
+        return;
+    }
+    if (openredirs(cmd) < 0)
+        return;
+
+#ifdef __linux__
+    if (outfd >= 0 && use_splice && (stage = memfd_create("tsh-relay", MFD_CLOEXEC)) < 0)
+        stage = outfd;
+#endif
+    outflush();
+    for (i = -1; i < cmd->nredirs; i++) {
+        if (i < 0 && outfd < 0)
+            continue;
+        r = &cmd->redirs[i < 0 ? 0 : i];
+        fd = i < 0 ? STDOUT_FILENO : r->fd;
+        if (fd > 2) {
+            outprintf("%s: redirection of fd %d is not supported for builtins\n", cmd->argv[0], fd);
+            continue;
+        }
+        if (saved[fd] < 0 && (saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10)) < 0)
+            unix_error("dup error");
+        if (i < 0)
+            dup2(stage, fd);
+        else
+            dup2(r->op == R_DUP ? r->dupfd : r->ofd, fd);
+        stdio_moved = 1; // No pool worker may inherit these
+    }
+    builtin_cmd(cmd->argv);
+    outflush();
+    for (fd = 0; fd < 3; fd++) {
+        if (saved[fd] >= 0) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+    stdio_moved = 0;
+    closeredirs(cmd);
+
+    if (stage != outfd) {
+        relay(stage, outfd);
+        close(stage);
+    }
+}
+
+/*
+ * relay - Copy the whole file from into the pipe to, by splice() when
+ *    the kernel allows it
+ */
+void relay(int from, int to) {
+    char buf[MAXLINE];
+    off_t off = 0, size = lseek(from, 0, SEEK_END);
+    ssize_t n;
+
+#ifdef __linux__
+    while (off < size && (n = splice(from, &off, to, NULL, size - off, SPLICE_F_MOVE)) > 0)
+        ;
+    if (off >= size || errno != EINVAL)
+        return; // Done, or the reader went away
+#endif
+    while ((n = pread(from, buf, sizeof(buf), off)) > 0) {
+        if (write(to, buf, n) != n)
+            return;
+        off += n;
+    }
+}
+
+/*
+ * spawn_job - Start cmd in process group pgid (a new group if pgid is
+ *    0) with stdin/stdout on infd/outfd when those are not -1, then the
+ *    redirections of cmd (already opened by openredirs()) applied, and
+ *    with the child's signal mask set to mask. By default the child is created with
+ *    posix_spawn(), which glibc implements with clone(CLONE_VM |
+ *    CLONE_VFORK) so the shell's page tables are never copied; -F
+ *    selects the classic fork()+execve() path instead, which waits on a
+ *    close-on-exec pipe to learn that the exec is done. With -Z an idle
+ *    pool worker, when there is one, is handed the command instead and
+ *    only has to exec it. A process of a job with a cgroup (cgfd, else
+ *    -1) takes the fork path, so that it starts inside the cgroup.
+ *    Bare command names are resolved through the command hash table.
+ *    Returns the pid of the child, or 0 if no child was started.
+ */
+pid_t spawn_job(struct cmd_t *cmd, const sigset_t *mask, pid_t pgid, int infd, int outfd, int cgfd) {
+    static posix_spawnattr_t attr;
+    static int attr_ready = 0;
+    posix_spawn_file_actions_t fa, *fap = NULL;
+    sigset_t sigdef;
+    char **argv = cmd->argv;
+    char *path = argv[0];
+    struct redir_t *r;
+    int cached = 0;
+    pid_t pid;
+    int err, ep[2];
+    ssize_t n;
+    uint64_t t0 = nsnow();
+
+    if (strchr(argv[0], '/') == NULL &&
+        (path = hash_lookup(argv[0], &cached)) == NULL) {
+        outflush(); // Keep stdout and stderr in order
+        fprintf(stderr, "%s: Command not found\n", argv[0]);
+        stats.spawnfails++;
+        last_status = 127;
+        return 0;
+    }
+
+    if (npool > 0 && (pid = pool_spawn(cmd, path, cached, mask, pgid, infd, outfd, cgfd)) >= 0) {
+        if (pid > 0) {
+            stats.spawns++;
+            histadd(&stats.spawnlat, nsnow() - t0);
+        }
+        return pid;
+    }
+
+    if (use_fork || cgfd >= 0) {
+        // The child's end of ep closes when the exec succeeds, or
+        // carries back its errno when it fails
+        if (pipe2(ep, O_CLOEXEC) < 0)
+            unix_error("pipe error");
+        if ((pid = cgfork(cgfd)) < 0)
+            unix_error("fork error");
+        if (pid == 0) { // Child process
+            close(ep[0]);
+            outq.head = outq.tail; // The shell's pending output is not ours
+            signal(SIGCHLD, SIG_DFL); // Drop the self-pipe relays, if any
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            sigprocmask(SIG_SETMASK, mask, NULL); // Restore the signal mask
+            setpgid(0, pgid); // Put the child in the job's process group
+            if (infd >= 0)
+                dup2(infd, STDIN_FILENO);
+            if (outfd >= 0)
+                dup2(outfd, STDOUT_FILENO);
+            for (r = cmd->redirs; r < cmd->redirs + cmd->nredirs; r++)
+                dup2(r->op == R_DUP ? r->dupfd : r->ofd, r->fd);
+
+            execve(path, argv, environ);
+            // A stale hash entry is only noticed here, so search PATH again
+            if (errno == ENOENT && cached)
+                execvp(argv[0], argv);
+            err = errno;
+            write(ep[1], &err, sizeof(err));
+            _exit(127);
+        }
+        setpgid(pid, pgid ? pgid : pid); // Don't race the next stage
+        close(ep[1]);
+        while ((n = read(ep[0], &err, sizeof(err))) < 0 && errno == EINTR)
+            ;
+        close(ep[0]);
+        if (n > 0) {
+            // As with posix_spawn(), a failed exec creates no job
+            reapchild(pid);
+            outflush();
+            fprintf(stderr, "%s: Command not found\n", argv[0]);
+            stats.spawnfails++;
+            last_status = 127;
+            return 0;
+        }
+        stats.spawns++;
+        histadd(&stats.spawnlat, nsnow() - t0);
+        return pid;
+    }
+
+    // The flags and defaulted signals never change, so set them once
+    if (!attr_ready) {
+        if ((err = posix_spawnattr_init(&attr)) != 0)
+            app_error("posix_spawnattr_init error");
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF);
+        sigemptyset(&sigdef);
+        sigaddset(&sigdef, SIGPIPE); // Ignored by the shell itself
+        posix_spawnattr_setsigdefault(&attr, &sigdef);
+        attr_ready = 1;
+    }
+    posix_spawnattr_setsigmask(&attr, mask);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    if (infd >= 0 || outfd >= 0 || cmd->nredirs > 0) {
+        posix_spawn_file_actions_init(&fa);
+        if (infd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, infd, STDIN_FILENO);
+        if (outfd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+        for (r = cmd->redirs; r < cmd->redirs + cmd->nredirs; r++)
+            posix_spawn_file_actions_adddup2(&fa, r->op == R_DUP ? r->dupfd : r->ofd, r->fd);
+        fap = &fa;
+    }
+
+    err = posix_spawn(&pid, path, fap, &attr, argv, environ);
+    if (err == ENOENT && cached) {
+        // The cached binary went away: forget it and search PATH again
+        hash_forget(argv[0]);
+        if ((path = hash_lookup(argv[0], &cached)) != NULL)
+            err = posix_spawn(&pid, path, fap, &attr, argv, environ);
+    }
+    if (fap != NULL)
+        posix_spawn_file_actions_destroy(fap);
+    if (err != 0 || path == NULL) {
+        // The exec failure is reported back to us, so no job is created
+        outflush(); // Keep stdout and stderr in order
+        fprintf(stderr, "%s: Command not found\n", argv[0]);
+        stats.spawnfails++;
+        last_status = 127;
+        return 0;
+    }
+    stats.spawns++;
+    histadd(&stats.spawnlat, nsnow() - t0);
+    return pid;
+}
+
+/*
+ * execcmd - Replace the shell with cmd, as the last thing it does: no
+ *    fork, no wait, and the command's exit status is the shell's own.
+ *    Exits 127 if cmd can't be started.
+ */
+void execcmd(struct cmd_t *cmd) {
+    char **argv = cmd->argv, *path = argv[0];
+    struct redir_t *r;
+
+    if (strchr(path, '/') == NULL && (path = path_search(argv[0])) == NULL) {
+        outflush();
+        fprintf(stderr, "%s: Command not found\n", argv[0]);
+        exit(127);
+    }
+    if (openredirs(cmd) < 0)
+        exit(1);
+    for (r = cmd->redirs; r < cmd->redirs + cmd->nredirs; r++)
+        dup2(r->op == R_DUP ? r->dupfd : r->ofd, r->fd);
+    outflush();
+    if (sig_fd >= 0) { // Undo initsignals(), if it has run
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &shell_mask, NULL);
+    }
+    execve(path, argv, environ);
+    fprintf(stderr, "%s: Command not found\n", argv[0]);
+    exit(127);
+}
+
+/*
+ * execsimple - Exec cmdline in place of the shell (-c) if it is one
+ *    command that execable() allows, before the job machinery is even
+ *    set up; returns if it is anything else
+ */
+void execsimple(char *cmdline) {
+    static struct parse_t ps;
+    struct pipeline_t *pl;
+
+    if (parseline(cmdline, &ps) != 1)
+        return;
+    pl = ps.pipes;
+    if (execable(pl))
+        execcmd(&pl->cmds[0]);
+}
+
+/*
+ * execable - Can pl be exec'd in place of the shell? It must be one
+ *    external command in the foreground, with no jobs left that the
+ *    shell would have to report or wait for, and no -C, -a, -s or -Z
+ *    setup that expects to see it as a job.
+ */
+int execable(const struct pipeline_t *pl) {
+    return pl->ncmds == 1 && !pl->bg && !pl->timed && !pl->captured && pl->node == NULL &&
+           !isbuiltin(pl->cmds[0].argv[0]) && jobs->npids == 0 &&
+           cg_path == NULL && place_policy == NULL && stats_file == NULL && poolsize == 0;
+}
+
+/*
+ * builtins - Every builtin command. Adding one is one line here; the
+ *    lookup goes through a hash index built from this table, so its
+ *    cost doesn't depend on how many there are.
+ */
+const struct builtin_t builtins[] = {
+    { "quit",     do_quit },     /* exit the shell */
+    { "jobs",     do_jobs },     /* list the jobs, -l with pids, times and usage */
+    { "bg",       do_bg },       /* continue a stopped job in the background */
+    { "fg",       do_fg },       /* continue a job in the foreground */
+    { "hash",     do_hash },     /* show or maintain the command hash table */
+    { "stats",    do_stats },    /* report the shell's counters and histograms */
+    { "parallel", do_parallel }, /* run a command over input lines, N at a time */
+    { "dag",      do_dag },      /* run the targets of a dependency file, N at a time */
+    { "limit",    do_limit },    /* set cgroup limits of new jobs or of one job */
+    { "history",  do_history },  /* list past command lines, or those with a prefix */
+    { "logs",     do_logs },     /* show the output of a job started with capture */
+    { "remote",   do_remote },   /* list the nodes, or say where @name sends jobs */
+};
+#define NBUILTINS (int)(sizeof(builtins) / sizeof(builtins[0]))
+
+/*
+ * findbuiltin - The builtin called name, or NULL. The index maps
+ *    strhash() of a name to 1 + its slot in builtins[], 0 for empty,
+ *    and is filled in on first use.
+ */
+const struct builtin_t *findbuiltin(const char *name) {
+    static unsigned char index[BUILTINHASH];
+    static int ready = 0;
+    unsigned int h;
+    int i;
+
+    if (!ready) {
+        for (i = 0; i < NBUILTINS; i++) {
+            for (h = strhash(builtins[i].name); index[h % BUILTINHASH] != 0; h++)
+                ;
+            index[h % BUILTINHASH] = i + 1;
+        }
+        ready = 1;
+    }
+    for (h = strhash(name); index[h % BUILTINHASH] != 0; h++) {
+        i = index[h % BUILTINHASH] - 1;
+        if (strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately.  
+ */
+int builtin_cmd(char **argv) {
+    const struct builtin_t *b = findbuiltin(argv[0]);
+
+    if (b == NULL)
+        return 0; // Not a builtin command
+    b->fn(argv);
+    return 1;
+}
+
+/* isbuiltin - Is name a builtin command? */
+int isbuiltin(const char *name) {
+    return findbuiltin(name) != NULL;
+}
+
+/* do_quit - Execute the builtin quit command */
+void do_quit(char **argv) {
+    exit(0);
+}
+
+/* do_jobs - Execute the builtin jobs command */
+void do_jobs(char **argv) {
+    listjobs(jobs, argv[1] != NULL && strcmp(argv[1], "-l") == 0);
+}
+
+/* do_bg, do_fg - Execute the builtin bg and fg commands */
+void do_bg(char **argv) {
+    do_bgfg(argv, BG);
+}
+
+void do_fg(char **argv) {
+    do_bgfg(argv, FG);
+}
+
+/* 
+ * do_bgfg - Move the job named by argv[1] to state (BG or FG)
+ */
+void do_bgfg(char **argv, int state) {
+    struct job_t *job = NULL;
+    pid_t pid;
+    int jid;
+
+    // Argument validation
+    if (argv[1] == NULL) {
+        outprintf("%s command requires PID or %%jobid argument\n", argv[0]);
+        return;
+    }
+
+    // Determine if argument is PID or JID and get the job
+    if (argv[1][0] == '%') {
+        jid = atoi(&argv[1][1]);
+        if (jid <= 0) {
+            outprintf("%s: argument must be a positive integer\n", argv[0]);
+            return;
+        }
+        job = getjobjid(jobs, jid);
+        if (job == NULL) {
+            outprintf("%s: No such job\n", argv[1]);
+            return;
+        }
+        pid = job->pid;
+    } else {
+        pid = atoi(argv[1]);
+        if (pid <= 0) {
+            outprintf("%s: argument must be a PID or %%jobid\n", argv[0]);
+            return;
+        }
+        job = getjobpid(jobs, pid);
+        if (job == NULL) {
+            outprintf("(%d): No such process\n", pid);
+            return;
+        }
+    }
+
+    // Send the job a continue signal, wherever it runs
+    if (signaljob(job, SIGCONT) < 0) {
+        outprintf("%s: %s\n", argv[1], strerror(errno));
+        return;
+    }
+
+    // Change the job state and possibly wait for it
+    if (state == BG) {
+        setjobstate(jobs, job, BG);
+        outprintf("[%d] (%d) %s\n", job->jid, job->pid, job->cmdline);
+    } else {
+        setjobstate(jobs, job, FG);
+        waitfg(job->pid);
+    }
+}
+
+/*
+ * do_parallel - Execute the builtin parallel command:
+ *
+ *    parallel [-j N] [-a file] cmd [args...]
+ *
+ *    Runs cmd once per line of file (stdin by default), with the line
+ *    as its last argument, keeping at most N jobs (the number of online
+ *    CPUs by default) running. A new job is started as soon as one is
+ *    reaped, and input is only read when there is room for a job.
+ */
+void do_parallel(char **argv) {
+    struct reader_t in, *rd = &in;
+    struct redir_t nullin;
+    struct cmd_t cmd;
+    char **args, *line, *text;
+    pid_t *running, pid;
+    struct job_t *job;
+    struct timespec t0, t1;
+    int i, n, nargs, nrunning = 0, stop = 0, fd = STDIN_FILENO, cgseq = 0, cgfd;
+    int placed, cpu, node;
+    long maxjobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && argv[i + 1] != NULL) {
+            if ((maxjobs = atoi(argv[++i])) <= 0) {
+                outprintf("parallel: -j needs a positive count\n");
+                return;
+            }
+        } else if (strcmp(argv[i], "-a") == 0 && argv[i + 1] != NULL) {
+            if ((fd = open(argv[++i], O_RDONLY | O_CLOEXEC)) < 0) {
+                outprintf("%s: %s\n", argv[i], strerror(errno));
+                return;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argv[i] == NULL) {
+        outprintf("usage: parallel [-j N] [-a file] cmd [args...]\n");
+        if (fd != STDIN_FILENO)
+            close(fd);
+        return;
+    }
+    if (maxjobs < 1)
+        maxjobs = 1;
+
+    for (nargs = 0; argv[i + nargs] != NULL; nargs++)
+        ;
+    if ((args = malloc((nargs + 2) * sizeof(char *))) == NULL ||
+        (running = malloc(maxjobs * sizeof(pid_t))) == NULL)
+        unix_error("parallel: malloc error");
+    memcpy(args, &argv[i], nargs * sizeof(char *));
+    args[nargs + 1] = NULL;
+
+    // Jobs must not eat the argument lines from our stdin
+    cmd.argv = args;
+    cmd.redirs = &nullin;
+    cmd.nredirs = 0;
+    if (fd == STDIN_FILENO) {
+        nullin.op = R_IN;
+        nullin.fd = STDIN_FILENO;
+        nullin.path = "/dev/null";
+        nullin.ofd = -1;
+        cmd.nredirs = 1;
+    }
+
+    // Lines on the shell's own input are taken from its buffer
+    if (fd == input.fd)
+        rd = &input;
+    else
+        initreader(&in, fd, INBUFSIZE);
+    interrupted = 0;
+    for (;;) {
+        // Forget the jobs that have been reaped
+        for (n = 0; n < nrunning; ) {
+            if (getjobpid(jobs, running[n]) == NULL)
+                running[n] = running[--nrunning];
+            else
+                n++;
+        }
+        if (interrupted) {
+            for (n = 0; n < nrunning; n++)
+                kill(-running[n], SIGINT);
+            interrupted = 0;
+            stop = 1;
+        }
+
+        if (!stop && nrunning < maxjobs) {
+            // Reading may reap jobs, so look at the table again first
+            if ((line = readline_fd(rd)) == NULL)
+                stop = 1;
+            if (line == NULL || *line == '\0')
+                continue;
+            args[nargs] = line;
+            // Job boundary, as in startpipeline(): the line may have come
+            // from the shell's own buffer, with no wait to flush output
+            wait_events(-1, 0);
+            if (openredirs(&cmd) < 0)
+                break;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            cgfd = cg_root >= 0 ? cgnew(&cgseq) : -1;
+            placed = placebegin(&cpu, &node);
+            pid = spawn_job(&cmd, &shell_mask, 0, -1, -1, cgfd);
+            clock_gettime(CLOCK_MONOTONIC, &t1); // It has exec'd
+            placeend();
+            closeredirs(&cmd);
+            if (pid == 0) {
+                if (cgfd >= 0)
+                    cgdone(cgseq, cgfd);
+                if (placed)
+                    placedone(cpu, node);
+                continue;
+            }
+            text = joinargs(args);
+            addjob(jobs, pid, BG, text);
+            job = getjobpid(jobs, pid);
+            job->flags |= JOB_QUIET;
+            job->cgseq = cgseq;
+            job->cgfd = cgfd;
+            if (placed) {
+                job->flags |= JOB_PLACED;
+                job->cpu = cpu;
+                job->node = node;
+            }
+            job->tstart = t0;
+            job->texec = t1;
+            free(text);
+            running[nrunning++] = pid;
+        } else if (nrunning > 0) {
+            wait_events(-1, -1);
+        } else {
+            break;
+        }
+    }
+
+    if (rd == &in) {
+        free(in.buf);
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    free(running);
+    free(args);
+}
+
+/* joinargs - Return a malloc'd copy of argv joined by spaces */
+char *joinargs(char **argv) {
+    size_t len = 1;
+    char *text, *p;
+    int i;
+
+    for (i = 0; argv[i] != NULL; i++)
+        len += strlen(argv[i]) + 1;
+    if ((p = text = malloc(len)) == NULL)
+        unix_error("joinargs: malloc error");
+    for (i = 0; argv[i] != NULL; i++) {
+        if (i > 0)
+            *p++ = ' ';
+        p = stpcpy(p, argv[i]);
+    }
+    *p = '\0';
+    return text;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid) {
+    uint64_t t0 = nsnow();
+
+    if (pid < 1) {
+        outprintf("waitfg: Invalid PID\n");
+        return;
+    }
+
+    // The job leaves the foreground when the event loop reaps or stops it
+    while (fgpid(jobs) == pid)
+        wait_events(-1, -1);
+    histadd(&stats.waitfg, nsnow() - t0);
+}
+
+/*****************
+ * Event loop
+ *****************/
+
+/*
+ * initsignals - Route SIGCHLD, SIGINT, SIGTSTP and SIGUSR2 (dump the
+ *    stats) to the event loop.
+ *    On Linux they stay blocked and are read from a signalfd; elsewhere
+ *    a handler reaps children itself, queues what it saw on the event
+ *    ring and wakes the loop through a self-pipe. Either way the job
+ *    table is only ever touched from ordinary program context.
+ */
+void initsignals(void) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGUSR2);
+
+    // A builtin writing into a pipeline must not die with its reader
+    Signal(SIGPIPE, SIG_IGN);
+
+#if USE_SIGNALFD
+    if (sigprocmask(SIG_BLOCK, &mask, &shell_mask) < 0)
+        unix_error("sigprocmask error");
+    if ((sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+#else
+    int fds[2];
+
+    if (sigprocmask(SIG_BLOCK, NULL, &shell_mask) < 0)
+        unix_error("sigprocmask error");
+    if (pipe(fds) < 0)
+        unix_error("pipe error");
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    sig_fd = fds[0];
+    sigpipe_w = fds[1];
+
+    // The four block each other, so the handler is the ring's only producer
+    struct sigaction action;
+
+    action.sa_handler = sigrelay_handler;
+    action.sa_mask = mask;
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGINT, &action, NULL) < 0 || sigaction(SIGTSTP, &action, NULL) < 0 ||
+        sigaction(SIGCHLD, &action, NULL) < 0 || sigaction(SIGUSR2, &action, NULL) < 0)
+        unix_error("Signal error");
+#endif
+}
+
+/*
+ * wait_events - Sleep for up to timeout ms (-1 is forever) until a
+ *    signal arrives, a job's pidfd or a node's connection becomes
+ *    readable or, if infd is not -1, infd becomes readable. Pending
+ *    signals, exits and messages from agents are dispatched here,
+ *    synchronously. Returns 1 if infd is readable.
+ *    With -U the shell sleeps in uring_wait() instead, and input is
+ *    read through the ring rather than waited on here.
+ */
+int wait_events(int infd, int timeout) {
+    static struct pollfd *fds = NULL;
+    static int fdcap = 0;
+    struct job_t *job;
+    int nfds = 2, npidfds, i, k;
+    uint64_t reaped;
+
+#if HAVE_URING
+    if (use_uring)
+        return uring_wait(timeout);
+#endif
+    timeout = captick(timeout);
+    if (fdcap < jobs->npids + nnodes + 2) {
+        fdcap = jobs->npids + nnodes + 2;
+        if ((fds = realloc(fds, fdcap * sizeof(struct pollfd))) == NULL)
+            unix_error("wait_events: realloc error");
+    }
+    fds[0].fd = sig_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = infd; /* poll skips negative fds */
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (use_pidfd) {
+        for (i = 0; i < jobs->cap; i++) {
+            job = &jobs->slots[i];
+            for (k = 0; job->pid != 0 && k < job->nprocs; k++) {
+                if (job->procs[k].pidfd >= 0) {
+                    fds[nfds].fd = job->procs[k].pidfd;
+                    fds[nfds].events = POLLIN;
+                    nfds++;
+                }
+            }
+        }
+    }
+    npidfds = nfds;
+    for (i = 0; i < nnodes; i++) {
+        if (nodes[i].fd >= 0) {
+            fds[nfds].fd = nodes[i].fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+    }
+
+    // Output is written out before the shell blocks, and before a
+    // pipeline starts (timeout 0) so it comes ahead of the jobs' own.
+    // The pool is topped up only when the shell is about to block.
+    outflush();
+    if (timeout != 0 && npool < poolsize)
+        pool_fill();
+    if (poll(fds, nfds, timeout) < 0) {
+        if (errno != EINTR)
+            unix_error("poll error");
+        return 0;
+    }
+
+    if (fds[0].revents & POLLIN) {
+#if USE_SIGNALFD
+        int chld = 0, sig;
+
+        for (;;) {
+            struct signalfd_siginfo si;
+            if (read(sig_fd, &si, sizeof(si)) != sizeof(si))
+                break;
+            sig = si.ssi_signo;
+            if (sig == SIGCHLD) {
+                chld = 1;       /* one sweep reaps every child */
+                stats.sigchld++;
+            } else {
+                eventsig(sig);
+            }
+        }
+        if (chld)
+            sigchld_handler(SIGCHLD);
+#else
+        char c[64];
+
+        // The bytes only wake us; what happened is on the ring
+        while (read(sig_fd, c, sizeof(c)) > 0)
+            ;
+#endif
+    }
+    evq_drain();
+
+    // A process that exited has a readable pidfd
+    reaped = stats.reaps;
+    for (i = 2; i < npidfds; i++)
+        if (fds[i].revents & POLLIN)
+            reap_pidfd(fds[i].fd);
+    if (stats.reaps != reaped)
+        histadd(&stats.sweep, stats.reaps - reaped);
+
+    // Output and state changes of remote jobs, for each node by its socket
+    for (i = npidfds; i < nfds; i++) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        for (k = 0; k < nnodes && nodes[k].fd != fds[i].fd; k++)
+            ;
+        if (k < nnodes)
+            node_input(&nodes[k]);
+    }
+
+    return infd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+/* eventsig - Act on a signal other than SIGCHLD taken by the event loop */
+void eventsig(int sig) {
+    if (sig == SIGINT)
+        sigint_handler(sig);
+    else if (sig == SIGTSTP)
+        sigtstp_handler(sig);
+    else if (sig == SIGUSR2)
+        dumpstats();
+}
+
+/*
+ * evq_drain - Dispatch the events the relay handler queued, in the
+ *    order it saw them. If the ring filled up, the children it had no
+ *    room for are still waiting and are reaped here with a sweep.
+ */
+void evq_drain(void) {
+#if !USE_SIGNALFD
+    struct event_t *ev;
+    unsigned int head = evq.head, sigchld;
+    uint64_t reaped = stats.reaps, now = nsnow();
+    static unsigned int seen;
+
+    while (head != __atomic_load_n(&evq.tail, __ATOMIC_ACQUIRE)) {
+        ev = &evq.ev[head % EVQSIZE];
+        histadd(&stats.evdelay, now - ev->ns);
+        if (ev->sig != SIGCHLD)
+            eventsig(ev->sig);
+        else if (ev->pid != 0)
+            childstatus(ev->pid, ev->code, ev->value, ev->hasru ? &ev->ru : NULL);
+        // The slot is free for the handler once head is past it
+        __atomic_store_n(&evq.head, ++head, __ATOMIC_RELEASE);
+    }
+    if ((sigchld = evq.sigchld) != seen) {
+        stats.sigchld += sigchld - seen;
+        seen = sigchld;
+        // The handler only collects stops there, as in sigchld_handler()
+        if (use_pidfd)
+            reap_untracked();
+        histadd(&stats.sweep, stats.reaps - reaped);
+    }
+    if (evq.overflow) {
+        evq.overflow = 0;
+        sigchld_handler(SIGCHLD);
+    }
+#endif
+}
+
+/*
+ * evq_forget - Drop the queued events for pid, a child that was never
+ *    given a job and has already been waited for
+ */
+void evq_forget(pid_t pid) {
+#if !USE_SIGNALFD
+    unsigned int i, tail = __atomic_load_n(&evq.tail, __ATOMIC_ACQUIRE);
+
+    // The handler only writes past tail, so these slots are ours
+    for (i = evq.head; i != tail; i++)
+        if (evq.ev[i % EVQSIZE].sig == SIGCHLD && evq.ev[i % EVQSIZE].pid == pid)
+            evq.ev[i % EVQSIZE].pid = 0;
+#endif
+}
+
+/*
+ * reapchild - Wait for pid, a child that failed before it got a job.
+ *    The relay handler may have reaped it first, and its status is then
+ *    on the event ring, where it would be reported as an unknown child.
+ */
+void reapchild(pid_t pid) {
+    int r;
+
+    while ((r = waitpid(pid, NULL, 0)) < 0 && errno == EINTR)
+        ;
+    if (r < 0 && errno == ECHILD)
+        evq_forget(pid);
+}
+
+/* initreader - Read lines from fd through a buffer of cap bytes */
+void initreader(struct reader_t *r, int fd, size_t cap) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->cap = cap;
+    if ((r->buf = malloc(cap)) == NULL)
+        unix_error("initreader: malloc error");
+}
+
+/*
+ * mapreader - Map the regular file fd so lines are split in place with
+ *    no read() calls at all. Lines are terminated by overwriting their
+ *    newline, so the mapping is private. Returns 0 if fd can't be used
+ *    that way.
+ */
+int mapreader(struct reader_t *r, int fd) {
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    char *map;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return 0;
+    // The last line needs a byte after it for its terminator
+    if (st.st_size % page == 0)
+        return 0;
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->buf = map;
+    r->end = st.st_size;
+    r->cap = st.st_size + 1; /* the zero fill of the last page */
+    r->eof = 1;
+    return 1;
+}
+
+/*
+ * readline_fd - Return the next line, NUL-terminated in place of its
+ *    newline. The line stays valid until the next call. Runs the event
+ *    loop while waiting for input. Returns NULL at end of file.
+ */
+char *readline_fd(struct reader_t *r) {
+    char *line, *nl;
+    ssize_t got;
+
+    for (;;) {
+        if ((nl = memchr(r->buf + r->scan, '\n', r->end - r->scan)) != NULL) {
+            *nl = '\0';
+            line = r->buf + r->start;
+            r->start = r->scan = nl + 1 - r->buf;
+            return line;
+        }
+        r->scan = r->end;
+        if (r->eof) {
+            if (r->start == r->end)
+                return NULL;
+            r->buf[r->end] = '\0'; // Last line without a newline
+            line = r->buf + r->start;
+            r->start = r->scan = r->end;
+            return line;
+        }
+
+        // Make room behind the partial line and read the next block
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->scan -= r->start;
+            r->start = 0;
+        }
+        if (r->end + 1 >= r->cap) {
+            r->cap *= 2;
+            if ((r->buf = realloc(r->buf, r->cap)) == NULL)
+                unix_error("readline_fd: realloc error");
+        }
+#if HAVE_URING
+        if (use_uring)
+            got = uring_read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+        else
+#endif
+        {
+            while (!wait_events(r->fd, -1))
+                ;
+            got = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+        }
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("read error");
+        }
+        if (got == 0)
+            r->eof = 1;
+        r->end += got;
+    }
+}
+
+/*
+ * atend - Is r known to hold nothing more than blank lines? Once the
+ *    buffer is used up this is asked of the fd without reading it: a
+ *    file is at its end when the offset is, and a pipe when it is
+ *    empty and its writer is gone, which polls as POLLHUP alone.
+ */
+int atend(struct reader_t *r) {
+    struct pollfd p = { r->fd, POLLIN, 0 };
+    struct stat st;
+    size_t i;
+
+    for (i = r->start; i < r->end; i++)
+        if (r->buf[i] != '\n' && r->buf[i] != ' ' && r->buf[i] != '\t')
+            return 0;
+    if (r->eof)
+        return 1;
+    if (fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode))
+        return lseek(r->fd, 0, SEEK_CUR) >= st.st_size;
+    return poll(&p, 1, 0) == 1 && p.revents == POLLHUP;
+}
+
+/* 
+ * sigchld_handler - Called from the event loop when the kernel has
+ *     sent SIGCHLD because a child job terminated (became a zombie),
+ *     stopped because it received a SIGSTOP or SIGTSTP signal, or
+ *     continued. It reaps all available zombie children and records
+ *     the state changes, but doesn't wait for any other currently
+ *     running children to terminate. With -P exits arrive on the
+ *     pidfds, so only stop and continue reports are collected here,
+ *     along with the exits of children that have no pidfd.
+ *     Where signalfd is missing the relay handler reaps instead, and
+ *     this sweep only runs when the event ring had no room left.
+ */
+void sigchld_handler(int sig) {
+    struct rusage ru;
+    uint64_t reaped;
+    pid_t pid;
+    int status;
+
+    if (use_pidfd) {
+        siginfo_t si;
+
+        for (;;) {
+            si.si_pid = 0;
+            if (waitid(P_ALL, 0, &si, WSTOPPED | WCONTINUED | WNOHANG) < 0 || si.si_pid == 0)
+                break;
+            childstatus(si.si_pid, si.si_code, si.si_status, NULL);
+        }
+        reap_untracked();
+        return;
+    }
+
+    reaped = stats.reaps;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        waitstatus(pid, status, &ru);
+    histadd(&stats.sweep, stats.reaps - reaped);
+}
+
+/*
+ * reap_untracked - With -P, collect the exits of the children that no
+ *    pidfd reports: idle pool workers, and processes whose pidfd_open()
+ *    failed, e.g. for want of descriptors
+ */
+void reap_untracked(void) {
+    struct job_t *job;
+    int i, k;
+
+    for (i = npool - 1; i >= 0; i--)
+        reapexit(pool[i].pid);
+    for (i = 0; i < jobs->cap; i++) {
+        job = &jobs->slots[i];
+        for (k = 0; job->pid != 0 && k < job->nprocs; k++)
+            if (job->procs[k].pidfd < 0 && job->procs[k].state != PS_DONE &&
+                job->procs[k].pid < REMOTEPID)
+                reapexit(job->procs[k].pid);
+    }
+}
+
+/* reapexit - Reap pid and apply its status if it has exited */
+void reapexit(pid_t pid) {
+    struct rusage ru;
+    int status;
+
+    if (wait4(pid, &status, WNOHANG, &ru) == pid)
+        waitstatus(pid, status, &ru);
+}
+
+/* waitstatus - Apply a status from wait4() to the job table */
+void waitstatus(pid_t pid, int status, const struct rusage *ru) {
+    if (WIFEXITED(status))
+        childstatus(pid, CLD_EXITED, WEXITSTATUS(status), ru);
+    else if (WIFSIGNALED(status))
+        childstatus(pid, CLD_KILLED, WTERMSIG(status), ru);
+    else if (WIFSTOPPED(status))
+        childstatus(pid, CLD_STOPPED, WSTOPSIG(status), NULL);
+    else if (WIFCONTINUED(status))
+        childstatus(pid, CLD_CONTINUED, SIGCONT, NULL);
+}
+
+/*
+ * reap_pidfd - A pidfd became readable: collect the exit of its process
+ */
+void reap_pidfd(int pidfd) {
+#if HAVE_PIDFD
+    struct rusage ru;
+    siginfo_t si;
+
+    // The raw call, as glibc's waitid() doesn't pass the rusage through
+    si.si_pid = 0;
+    if (syscall(SYS_waitid, P_PIDFD, pidfd, &si, WEXITED | WNOHANG, &ru) < 0 || si.si_pid == 0)
+        return;
+    childstatus(si.si_pid, si.si_code, si.si_status, &ru);
+#endif
+}
+
+/*
+ * childstatus - Apply a state change of child pid to the job table.
+ *     code is a CLD_* value from <signal.h> and value the exit status
+ *     or signal number that goes with it; ru is the usage of a reaped
+ *     process. A job is done when all of its processes are, and
+ *     reports the status of its last process.
+ */
+void childstatus(pid_t pid, int code, int value, const struct rusage *ru) {
+    struct job_t *job = getjobpid(jobs, pid);
+    struct timespec now;
+    int fg, k;
+
+    if (!job) {
+        if (!pool_reaped(pid, code))
+            outprintf("sigchld_handler: No job found for PID %d\n", pid);
+        return;
+    }
+    for (k = 0; job->procs[k].pid != pid; k++)
+        ;
+    fg = job->state == FG; // Reported at once, as the command's own result
+
+    switch (code) {
+        case CLD_EXITED:
+        case CLD_KILLED:
+        case CLD_DUMPED:
+            procdone(jobs, job, k);
+            stats.reaps++;
+            if (ru != NULL)
+                addrusage(&job->ru, ru);
+            if (k == job->nprocs - 1) {
+                job->code = code;
+                job->value = value;
+            }
+            if (job->nlive > 0)
+                break;
+            if (fg)
+                last_status = job->code == CLD_EXITED ? job->value : 128 + job->value;
+            if (job->flags & JOB_WATCH) {
+                exits = growarray(exits, &exitcap, nexits + 1, sizeof(*exits));
+                exits[nexits].pid = job->pid;
+                exits[nexits].code = job->code == CLD_EXITED ? CLD_EXITED : CLD_KILLED;
+                exits[nexits++].value = job->value;
+            } else if (job->code == CLD_EXITED) {
+                // A foreground job that exits normally is not reported
+                if (!fg && !((job->flags & JOB_QUIET) && job->value == 0))
+                    notejob(job, CLD_EXITED, job->value, 0);
+            } else {
+                notejob(job, CLD_KILLED, job->value, fg);
+            }
+            if (job->flags & JOB_TIMED) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                printtimes(tsdiff(&job->tstart, &now), tvsec(&job->ru.ru_utime), tvsec(&job->ru.ru_stime));
+            }
+            removejob(jobs, job);
+            break;
+        case CLD_STOPPED:
+        case CLD_TRAPPED:
+            job->procs[k].state = PS_STOP;
+            if (job->state == ST)
+                break;  /* another process of the job already stopped */
+            if (fg)
+                last_status = 128 + value;
+            setjobstate(jobs, job, ST);
+            notejob(job, CLD_STOPPED, value, fg);
+            break;
+        case CLD_CONTINUED:
+            job->procs[k].state = PS_RUN;
+            // bg and fg have already moved the job out of ST
+            if (job->state != ST)
+                break;
+            setjobstate(jobs, job, BG);
+            notejob(job, CLD_CONTINUED, SIGCONT, 0);
+            break;
+    }
+}
+
+/*
+ * sigint_handler - Forward a ctrl-c to the foreground job, if any,
+ *     or else note it for the builtin that is running
+ */
+void sigint_handler(int sig) {
+    pid_t fg_pid = fgpid(jobs); // Get the PID of the foreground job
+
+    if (fg_pid != 0) {
+        // If there is a foreground job, send SIGINT to the process group of the job
+        signaljob(&jobs->slots[jobs->fgslot], SIGINT);
+    } else {
+        interrupted = 1; // Lets a running builtin such as parallel stop
+    }
+}
+
+/*
+ * sigtstp_handler - Forward a ctrl-z to the foreground job, if any. The
+ *     job is marked stopped once sigchld_handler sees it stop.
+ */
+void sigtstp_handler(int sig) {
+    pid_t fg_pid = fgpid(jobs); // Get the PID of the foreground job
+
+    if (fg_pid != 0) {
+        // If there is a foreground job, send SIGTSTP to the process group of the job
+        signaljob(&jobs->slots[jobs->fgslot], SIGTSTP);
+    }
+}
+
+/*
+ * sigrelay_handler - Relay used where signalfd is missing. SIGCHLD is
+ *     answered by reaping every child that changed state (or only the
+ *     stopped and continued ones with -P, whose exits come on pidfds),
+ *     and each signal or child goes onto the event ring with the time
+ *     it was seen. The handler touches nothing else, and writes to the
+ *     self-pipe only when the ring was empty and the loop may be asleep.
+ *     With -U the ring reaps children itself, so SIGCHLD just wakes it.
+ */
+void sigrelay_handler(int sig) {
+#if !USE_SIGNALFD
+    int olderrno = errno, status;
+    unsigned int tail = evq.tail, head = __atomic_load_n(&evq.head, __ATOMIC_ACQUIRE);
+    uint64_t now = nsnow();
+    int empty = tail == head;
+    struct event_t *ev;
+    siginfo_t si;
+    pid_t pid;
+
+    if (sig != SIGCHLD || use_uring) {
+        if (tail - head == EVQSIZE) {
+            evq.overflow = 1;
+        } else {
+            ev = &evq.ev[tail++ % EVQSIZE];
+            ev->sig = sig;
+            ev->pid = 0;
+            ev->ns = now;
+        }
+    } else {
+        evq.sigchld++;
+        for (;;) {
+            if (tail - head == EVQSIZE) {
+                evq.overflow = 1; // The rest stay zombies for evq_drain()
+                break;
+            }
+            ev = &evq.ev[tail % EVQSIZE];
+            if (use_pidfd) {
+                si.si_pid = 0;
+                if (waitid(P_ALL, 0, &si, WSTOPPED | WCONTINUED | WNOHANG) < 0 || si.si_pid == 0)
+                    break;
+                ev->pid = si.si_pid;
+                ev->code = si.si_code;
+                ev->value = si.si_status;
+                ev->hasru = 0;
+            } else {
+                if ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ev->ru)) <= 0)
+                    break;
+                ev->pid = pid;
+                ev->hasru = 1;
+                if (WIFEXITED(status)) {
+                    ev->code = CLD_EXITED;
+                    ev->value = WEXITSTATUS(status);
+                } else if (WIFSIGNALED(status)) {
+                    ev->code = WCOREDUMP(status) ? CLD_DUMPED : CLD_KILLED;
+                    ev->value = WTERMSIG(status);
+                } else if (WIFSTOPPED(status)) {
+                    ev->code = CLD_STOPPED;
+                    ev->value = WSTOPSIG(status);
+                } else {
+                    ev->code = CLD_CONTINUED;
+                    ev->value = SIGCONT;
+                }
+            }
+            ev->sig = SIGCHLD;
+            ev->ns = now;
+            tail++;
+        }
+    }
+
+    // A ring that was not empty already has its wakeup on the way
+    __atomic_store_n(&evq.tail, tail, __ATOMIC_RELEASE);
+    if (empty && tail != head && write(sigpipe_w, "", 1) < 0) {
+        // The pipe is full; the loop still has a wakeup pending
+    }
+    errno = olderrno;
+#endif
+}
+
+/*
+ * sigusr1_handler - child is ready
+ */
+void sigusr1_handler(int sig) {
+    ready = 1;
+}
+
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/*
+ * arenaclass - Size class for an n-byte request. Chunks are rounded up
+ *    to a power of two so a freed chunk can serve any later request of
+ *    the same class.
+ */
+static inline int arenaclass(size_t n) {
+    int k = 0;
+
+    while (((size_t)16 << k) < n)
+        k++;
+    return k;
+}
+
+/*
+ * arena_alloc - Allocate n bytes from the arena. Chunks are recycled
+ *    per size class and never handed back to malloc, so arena_free()
+ *    is just a couple of stores.
+ */
+void *arena_alloc(struct arena_t *a, size_t n) {
+    int k = arenaclass(n);
+    size_t size = (size_t)16 << k;
+    void *p;
+
+    if (k >= ARENACLASSES)
+        app_error("arena_alloc: request too large");
+    if ((p = a->freelist[k]) != NULL) {
+        a->freelist[k] = *(void **)p;
+        return p;
+    }
+    if (size > ARENABLOCK / 4) {  /* big chunks get a block of their own */
+        if ((p = malloc(size)) == NULL)
+            unix_error("arena_alloc: malloc error");
+        return p;
+    }
+    if ((size_t)(a->end - a->next) < size) {
+        if ((a->next = malloc(ARENABLOCK)) == NULL)
+            unix_error("arena_alloc: malloc error");
+        a->end = a->next + ARENABLOCK;
+    }
+    p = a->next;
+    a->next += size;
+    return p;
+}
+
+/* arena_free - Return an n-byte chunk from arena_alloc() to the arena */
+void arena_free(struct arena_t *a, void *p, size_t n) {
+    int k = arenaclass(n);
+
+    *(void **)p = a->freelist[k];
+    a->freelist[k] = p;
+}
+
+/* arena_strdup - Copy a string into the arena */
+char *arena_strdup(struct arena_t *a, const char *s) {
+    size_t n = strlen(s) + 1;
+
+    return memcpy(arena_alloc(a, n), s, n);
+}
+
+/* proccap - Room for n processes: arrays grow in powers of two */
+static inline int proccap(int n) {
+    int cap = 1;
+
+    while (cap < n)
+        cap *= 2;
+    return cap;
+}
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    if (job->cmdline != NULL)
+        arena_free(&jobarena, job->cmdline, strlen(job->cmdline) + 1);
+    job->cmdline = NULL;
+    if (job->procs != NULL)
+        arena_free(&jobarena, job->procs, proccap(job->nprocs) * sizeof(struct proc_t));
+    job->procs = NULL;
+    job->nprocs = job->nlive = 0;
+    job->flags = 0;
+    job->cgseq = 0;
+    job->ex = NULL;
+    memset(&job->tstart, 0, sizeof(job->tstart));
+    memset(&job->texec, 0, sizeof(job->texec));
+    memset(&job->ru, 0, sizeof(job->ru));
+}
+
+/* pidslot - Home position of pid in the pid index */
+static inline int pidslot(struct jobtab_t *jobs, pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & (jobs->pidcap - 1);
+}
+
+/*
+ * pidmap_rebuild - Resize the pid index to cap entries (a power of
+ *    two) and re-enter the processes of every job that are still live.
+ */
+void pidmap_rebuild(struct jobtab_t *jobs, int cap) {
+    struct job_t *job;
+    int i, k;
+
+    free(jobs->pidmap);
+    if ((jobs->pidmap = malloc(cap * sizeof(struct pident_t))) == NULL)
+        unix_error("job table allocation error");
+    jobs->pidcap = cap;
+    jobs->npids = 0;
+    for (i = 0; i < cap; i++)
+        jobs->pidmap[i].slot = -1;
+    for (i = 0; i < jobs->cap; i++) {
+        job = &jobs->slots[i];
+        for (k = 0; job->pid != 0 && k < job->nprocs; k++)
+            if (job->procs[k].state != PS_DONE)
+                pidmap_insert(jobs, job->procs[k].pid, i);
+    }
+}
+
+/* pidmap_insert - Record that pid belongs to the job in slot i */
+void pidmap_insert(struct jobtab_t *jobs, pid_t pid, int i) {
+    int h;
+
+    for (h = pidslot(jobs, pid); jobs->pidmap[h].slot >= 0; h = (h + 1) & (jobs->pidcap - 1))
+        ;
+    jobs->pidmap[h].pid = pid;
+    jobs->pidmap[h].slot = i;
+    jobs->npids++;
+}
+
+/*
+ * pidmap_remove - Remove pid from the pid index. Later entries of the
+ *    probe run are shifted back so lookups never need tombstones.
+ */
+void pidmap_remove(struct jobtab_t *jobs, pid_t pid) {
+    int mask = jobs->pidcap - 1;
+    int h = pidslot(jobs, pid);
+    int i, home;
+
+    while (jobs->pidmap[h].slot >= 0 && jobs->pidmap[h].pid != pid)
+        h = (h + 1) & mask;
+    if (jobs->pidmap[h].slot < 0)
+        return;
+
+    for (i = (h + 1) & mask; jobs->pidmap[i].slot >= 0; i = (i + 1) & mask) {
+        home = pidslot(jobs, jobs->pidmap[i].pid);
+        /* move entry i into the hole at h unless its home lies in (h, i] */
+        if (((i - home) & mask) >= ((i - h) & mask)) {
+            jobs->pidmap[h] = jobs->pidmap[i];
+            h = i;
+        }
+    }
+    jobs->pidmap[h].slot = -1;
+    jobs->npids--;
+}
+
+/*
+ * growjobs - Double the capacity of the job table. Job slots keep
+ *    their index (and so their JID).
+ */
+void growjobs(struct jobtab_t *jobs) {
+    int oldcap = jobs->cap;
+    int cap = oldcap ? 2 * oldcap : INITJOBS;
+    int words = (cap + 63) / 64;
+    int i;
+
+    jobs->slots = realloc(jobs->slots, cap * sizeof(struct job_t));
+    jobs->freemap = realloc(jobs->freemap, words * sizeof(uint64_t));
+    if (!jobs->slots || !jobs->freemap)
+        unix_error("job table allocation error");
+
+    memset(jobs->freemap + oldcap / 64, 0, (words - oldcap / 64) * sizeof(uint64_t));
+    memset(jobs->slots + oldcap, 0, (cap - oldcap) * sizeof(struct job_t));
+    for (i = oldcap; i < cap; i++) {
+        jobs->freemap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    jobs->cap = cap;
+}
+
+/*
+ * initjobs - Initialize the job list. Nothing is allocated until the
+ *    first job is added, so a shell that never starts one doesn't pay
+ *    for the table.
+ */
+void initjobs(struct jobtab_t *jobs) {
+    memset(jobs, 0, sizeof(*jobs));
+    jobs->fgslot = -1;
+}
+
+/* freejid - Returns smallest free job ID, 0 if the table is full */
+int freejid(struct jobtab_t *jobs) {
+    int i;
+
+    for (i = 0; i < (jobs->cap + 63) / 64; i++)
+        if (jobs->freemap[i])
+            return i * 64 + __builtin_ctzll(jobs->freemap[i]) + 1;
+    return 0;
+}
+
+/* addjob - Add a job to the job list, with pid as its first process */
+int addjob(struct jobtab_t *jobs, pid_t pid, int state, char *cmdline) {
+    struct job_t *job;
+    int jid;
+
+    if (pid < 1)
+        return 0;
+
+    if ((jid = freejid(jobs)) == 0) {
+        growjobs(jobs);
+        jid = freejid(jobs);
+    }
+    job = &jobs->slots[jid - 1];
+    job->pid = pid;
+    job->state = state;
+    job->jid = jid;
+    job->cmdline = arena_strdup(&jobarena, cmdline);
+    job->ex = &executors[0]; // Local, unless the caller says otherwise
+    jobs->freemap[(jid - 1) / 64] &= ~((uint64_t)1 << ((jid - 1) % 64));
+    if (state == FG)
+        jobs->fgslot = jid - 1;
+    addproc(jobs, job, pid);
+    if (++stats.jobs > stats.jobsmax)
+        stats.jobsmax = stats.jobs;
+
+    if(verbose){
+        outprintf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* addproc - Add process pid to job, e.g. the next stage of a pipeline */
+int addproc(struct jobtab_t *jobs, struct job_t *job, pid_t pid) {
+    struct proc_t *procs = job->procs, *proc;
+    int n = job->nprocs;
+
+    if (pid < 1)
+        return 0;
+
+    if (2 * (jobs->npids + 1) > jobs->pidcap)  /* keep the pid index under half full */
+        pidmap_rebuild(jobs, jobs->pidcap ? 2 * jobs->pidcap : 2 * INITJOBS);
+    if (n == 0 || proccap(n) == n) {
+        procs = arena_alloc(&jobarena, proccap(n + 1) * sizeof(struct proc_t));
+        if (n > 0) {
+            memcpy(procs, job->procs, n * sizeof(struct proc_t));
+            arena_free(&jobarena, job->procs, proccap(n) * sizeof(struct proc_t));
+        }
+        job->procs = procs;
+    }
+    proc = &procs[n];
+    proc->pid = pid;
+    proc->state = PS_RUN;
+    proc->pidfd = -1;
+#if HAVE_PIDFD
+    // Without a pidfd, as when descriptors run out, the process is
+    // left to reap_untracked(); without the system call, so is -P
+    if (use_pidfd && pid < REMOTEPID && (proc->pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0 &&
+        errno == ENOSYS)
+        use_pidfd = 0;
+#endif
+    job->nprocs++;
+    job->nlive++;
+    pidmap_insert(jobs, pid, job - jobs->slots);
+    return 1;
+}
+
+/*
+ * procdone - Process k of job has been reaped. Its pid may be reused
+ *    from now on, so it leaves the pid index.
+ */
+void procdone(struct jobtab_t *jobs, struct job_t *job, int k) {
+    struct proc_t *proc = &job->procs[k];
+
+    if (proc->pidfd >= 0)
+        close(proc->pidfd);
+    proc->pidfd = -1;
+    proc->state = PS_DONE;
+    pidmap_remove(jobs, proc->pid);
+    job->nlive--;
+}
+
+/* deletejob - Delete the job that process pid belongs to */
+int deletejob(struct jobtab_t *jobs, pid_t pid) {
+    struct job_t *job;
+
+    if (pid < 1)
+        return 0;
+
+    if ((job = getjobpid(jobs, pid)) == NULL)
+        return 0;
+    removejob(jobs, job);
+    return 1;
+}
+
+/* removejob - Remove job from the job list */
+void removejob(struct jobtab_t *jobs, struct job_t *job) {
+    int i = job - jobs->slots;
+    int k;
+
+    for (k = 0; k < job->nprocs; k++)
+        if (job->procs[k].state != PS_DONE)
+            procdone(jobs, job, k);
+    if (job->cgseq != 0)
+        cgdone(job->cgseq, job->cgfd);
+    if (job->flags & JOB_PLACED)
+        placedone(job->cpu, job->node);
+    clearjob(job);
+    stats.jobs--;
+    jobs->freemap[i / 64] |= (uint64_t)1 << (i % 64);
+    if (jobs->fgslot == i)
+        jobs->fgslot = -1;
+}
+
+/* setjobstate - Change the state of a job, tracking the foreground job */
+void setjobstate(struct jobtab_t *jobs, struct job_t *job, int state) {
+    int i = job - jobs->slots;
+
+    job->state = state;
+    if (state == FG)
+        jobs->fgslot = i;
+    else if (jobs->fgslot == i)
+        jobs->fgslot = -1;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct jobtab_t *jobs) {
+    if (jobs->fgslot < 0)
+        return 0;
+    return jobs->slots[jobs->fgslot].pid;
+}
+
+/* getjobpid  - Find a job (by the PID of any live process) on the job list */
+struct job_t *getjobpid(struct jobtab_t *jobs, pid_t pid) {
+    int h;
+
+    if (pid < 1 || jobs->pidcap == 0)
+        return NULL;
+    for (h = pidslot(jobs, pid); jobs->pidmap[h].slot >= 0; h = (h + 1) & (jobs->pidcap - 1))
+        if (jobs->pidmap[h].pid == pid)
+            return &jobs->slots[jobs->pidmap[h].slot];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct jobtab_t *jobs, int jid) 
+{
+    if (jid < 1 || jid > jobs->cap || jobs->slots[jid - 1].pid == 0)
+        return NULL;
+    return &jobs->slots[jid - 1];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+
+    return job ? job->jid : 0;
+}
+
+/*
+ * listjobs - Print the job list. With details, each job is followed by
+ *     its pids, how long it has been up, how long its processes took to
+ *     be started and exec, and the resources used by those reaped.
+ */
+void listjobs(struct jobtab_t *jobs, int details) {
+    static const char *pstate[] = { "", " (stopped)", " (done)" };
+    struct timespec now;
+    struct job_t *job;
+    int i, k;
+
+    if (details)
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < jobs->cap; i++) {
+        job = &jobs->slots[i];
+        if (job->pid != 0) {
+            outprintf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
+                case BG: 
+                    outprintf("Running ");
+                    break;
+                case FG: 
+                    outprintf("Foreground ");
+                    break;
+                case ST: 
+                    outprintf("Stopped ");
+                    break;
+                default:
+                    outprintf("listjobs: Internal error: job[%d].state=%d ", 
+                       i, job->state);
+            }
+            outprintf("%s\n", job->cmdline);
+            if (!details)
+                continue;
+            outprintf("    pids");
+            for (k = 0; k < job->nprocs; k++)
+                outprintf(" %d%s", job->procs[k].pid, pstate[job->procs[k].state]);
+            outprintf("\n    up %.3fs, spawn %.3fms, user %.3fs, sys %.3fs, maxrss %ldK, "
+                   "faults %ld/%ld, csw %ld/%ld\n",
+                   tsdiff(&job->tstart, &now), 1e3 * tsdiff(&job->tstart, &job->texec),
+                   tvsec(&job->ru.ru_utime), tvsec(&job->ru.ru_stime), job->ru.ru_maxrss,
+                   job->ru.ru_minflt, job->ru.ru_majflt, job->ru.ru_nvcsw, job->ru.ru_nivcsw);
+            if (job->cgseq != 0)
+                cgreport(job->cgfd);
+            if (job->flags & JOB_PLACED)
+                placereport(job);
+            if (job->flags & JOB_CAPTURED)
+                capreport(job);
+        }
+    }
+}
+
+/* tsdiff - Seconds from a to b */
+double tsdiff(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* tvsec - A timeval in seconds */
+double tvsec(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* addrusage - Add the usage of one more process to sum */
+void addrusage(struct rusage *sum, const struct rusage *ru) {
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss; // Not a sum: the largest process
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_inblock += ru->ru_inblock;
+    sum->ru_oublock += ru->ru_oublock;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* printtimes - Report times the way bash's time keyword does */
+void printtimes(double real, double user, double sys) {
+    outprintf("\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+           (int)(real / 60), real - 60 * (int)(real / 60),
+           (int)(user / 60), user - 60 * (int)(user / 60),
+           (int)(sys / 60), sys - 60 * (int)(sys / 60));
+}
+
+
+/*
+ * notejob - Report a state change of job: at once if now or with -b,
+ *    else queued for reportnotes() so a burst costs one report
+ */
+void notejob(struct job_t *job, int code, int value, int now) {
+    struct note_t n = { job->jid, job->pid, code, value };
+
+    if (now || notify_now) {
+        printnote(&n);
+        return;
+    }
+    notes = growarray(notes, &notecap, nnotes + 1, sizeof(*notes));
+    notes[nnotes++] = n;
+}
+
+/* printnote - The line reporting one state change */
+void printnote(const struct note_t *n) {
+    switch (n->code) {
+        case CLD_EXITED:
+            outprintf("Job [%d] (%d) exited with status %d\n", n->jid, n->pid, n->value);
+            break;
+        case CLD_KILLED:
+            outprintf("Job [%d] (%d) terminated by signal %d\n", n->jid, n->pid, n->value);
+            break;
+        case CLD_STOPPED:
+            outprintf("Job [%d] (%d) stopped by signal %d\n", n->jid, n->pid, n->value);
+            break;
+        case CLD_CONTINUED:
+            outprintf("Job [%d] (%d) continued\n", n->jid, n->pid);
+            break;
+    }
+}
+
+/*
+ * reportnotes - Report the queued state changes, in order. Stops and
+ *    continues are always listed; when more than NOTEBATCH jobs ended,
+ *    the ends are summed up by outcome instead.
+ */
+void reportnotes(void) {
+    int ended = 0, done = 0, failed = 0, killed = 0, i;
+    struct note_t *n;
+
+    if (nnotes == 0)
+        return;
+    for (n = notes; n < notes + nnotes; n++)
+        ended += n->code == CLD_EXITED || n->code == CLD_KILLED;
+    for (i = 0; i < nnotes; i++) {
+        n = &notes[i];
+        if (ended <= NOTEBATCH || n->code == CLD_STOPPED || n->code == CLD_CONTINUED)
+            printnote(n);
+        else if (n->code == CLD_KILLED)
+            killed++;
+        else if (n->value == 0)
+            done++;
+        else
+            failed++;
+    }
+    if (done > 0)
+        outprintf("%d job%s done\n", done, done == 1 ? "" : "s");
+    if (failed > 0)
+        outprintf("%d job%s exited with nonzero status\n", failed, failed == 1 ? "" : "s");
+    if (killed > 0)
+        outprintf("%d job%s terminated by signal\n", killed, killed == 1 ? "" : "s");
+    nnotes = 0;
+}
+
+/******************************************************
+ * Helper routines that manipulate the command hash table
+ ******************************************************/
+
+/* strhash - FNV-1a hash of a string */
+unsigned int strhash(const char *s) {
+    unsigned int h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* path_search - Find name on $PATH, returns a malloc'd path or NULL */
+char *path_search(const char *name) {
+    const char *dirs = getenv("PATH");
+    const char *dir, *end;
+    size_t dlen, nlen = strlen(name);
+    struct stat st;
+    char *path;
+
+    if (dirs == NULL)
+        dirs = "/bin:/usr/bin";
+    if ((path = malloc(strlen(dirs) + nlen + 3)) == NULL)
+        unix_error("malloc error");
+
+    for (dir = dirs; ; dir = end + 1) {
+        if ((end = strchr(dir, ':')) == NULL)
+            end = dir + strlen(dir);
+        dlen = end - dir;
+        if (dlen == 0) {  /* empty entry means the current directory */
+            path[0] = '.';
+            dlen = 1;
+        } else {
+            memcpy(path, dir, dlen);
+        }
+        path[dlen] = '/';
+        memcpy(path + dlen + 1, name, nlen + 1);
+        // As execvp() does, skip directories and go on down the PATH
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+            return path;
+        if (*end == '\0')
+            break;
+    }
+    free(path);
+    return NULL;
+}
+
+/*
+ * hash_lookup - Return the absolute path for command name, searching
+ *    $PATH and caching the result on a miss. *cached is set if the
+ *    path came from the table rather than a fresh search. The whole
+ *    table is dropped first if $PATH changed since it was filled.
+ */
+char *hash_lookup(const char *name, int *cached) {
+    const char *pathvar = getenv("PATH");
+    unsigned int b = strhash(name) % HASHSIZE;
+    struct cmdhash_t *h;
+    char *path;
+
+    if (pathvar == NULL)
+        pathvar = "";
+    if (hashed_path == NULL || strcmp(hashed_path, pathvar) != 0) {
+        hash_clear();
+        if ((hashed_path = strdup(pathvar)) == NULL)
+            unix_error("strdup error");
+    }
+
+    for (h = cmdhash[b]; h != NULL; h = h->next) {
+        if (strcmp(h->name, name) == 0) {
+            h->hits++;
+            *cached = 1;
+            return h->path;
+        }
+    }
+
+    *cached = 0;
+    if ((path = path_search(name)) == NULL)
+        return NULL;
+    if ((h = malloc(sizeof(*h))) == NULL || (h->name = strdup(name)) == NULL)
+        unix_error("malloc error");
+    h->path = path;
+    h->hits = 1;
+    h->next = cmdhash[b];
+    cmdhash[b] = h;
+    return path;
+}
+
+/* hash_forget - Drop the table entry for name, if any */
+void hash_forget(const char *name) {
+    struct cmdhash_t **hp, *h;
+
+    for (hp = &cmdhash[strhash(name) % HASHSIZE]; (h = *hp) != NULL; hp = &h->next) {
+        if (strcmp(h->name, name) == 0) {
+            *hp = h->next;
+            free(h->name);
+            free(h->path);
+            free(h);
+            return;
+        }
+    }
+}
+
+/* hash_clear - Empty the command hash table */
+void hash_clear(void) {
+    struct cmdhash_t *h, *next;
+    int i;
+
+    for (i = 0; i < HASHSIZE; i++) {
+        for (h = cmdhash[i]; h != NULL; h = next) {
+            next = h->next;
+            free(h->name);
+            free(h->path);
+            free(h);
+        }
+        cmdhash[i] = NULL;
+    }
+}
+
+/*
+ * do_hash - Execute the builtin hash command. With no arguments list
+ *    the table, with -r empty it, otherwise (re)hash each name.
+ */
+void do_hash(char **argv) {
+    struct cmdhash_t *h;
+    int i, cached;
+
+    if (argv[1] == NULL) {
+        outprintf("hits\tcommand\n");
+        for (i = 0; i < HASHSIZE; i++)
+            for (h = cmdhash[i]; h != NULL; h = h->next)
+                outprintf("%4d\t%s\n", h->hits, h->path);
+        return;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        hash_clear();
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        hash_forget(argv[i]);
+        if (strchr(argv[i], '/') != NULL || hash_lookup(argv[i], &cached) == NULL)
+            outprintf("hash: %s: not found\n", argv[i]);
+    }
+}
+
+
+/******************************************************
+ * Helper routines that manipulate the parse cache
+ ******************************************************/
+
+/*
+ * pcache_lookup - Return the cached parse of cmdline, whose strhash()
+ *    is hash, moving it to the front of the LRU list; NULL on a miss
+ */
+struct pcache_t *pcache_lookup(const char *cmdline, unsigned int hash) {
+    struct pcache_t *pc;
+
+    for (pc = pcache[hash % PCACHESIZE]; pc != NULL; pc = pc->next) {
+        if (pc->hash == hash && strcmp(pc->line, cmdline) == 0)
+            break;
+    }
+    if (pc == NULL) {
+        pcache_misses++;
+        return NULL;
+    }
+    pcache_hits++;
+    if (pc != pcache_mru) {
+        // Move to the front
+        pc->newer->older = pc->older;
+        if (pc->older != NULL)
+            pc->older->newer = pc->newer;
+        else
+            pcache_lru = pc->newer;
+        pc->newer = NULL;
+        pc->older = pcache_mru;
+        pcache_mru->newer = pc;
+        pcache_mru = pc;
+    }
+    return pc;
+}
+
+/*
+ * pcache_store - Copy the n pipelines that parseline() built in ps for
+ *    cmdline into a single allocation and cache it, evicting the least
+ *    recently used lines to stay within PCACHEMEM bytes. Every pointer
+ *    is moved over to the copy, so ps can be reused at once. Returns
+ *    the entry, or NULL if the line is too big to be worth caching.
+ */
+struct pcache_t *pcache_store(const char *cmdline, unsigned int hash, struct parse_t *ps, int n) {
+    struct pipeline_t *lastpl = &ps->pipes[n - 1];
+    struct cmd_t *lastcmd = &lastpl->cmds[lastpl->ncmds - 1];
+    struct pcache_t *pc, *victim, **pp;
+    struct cmd_t *cmds;
+    struct redir_t *redirs;
+    char **argv, *text;
+    int ncmds, nredirs, nargv, len = strlen(cmdline), i;
+    size_t size;
+
+    // parseline() fills each array front to back
+    ncmds = lastcmd + 1 - ps->cmds;
+    nredirs = lastcmd->redirs + lastcmd->nredirs - ps->redirs;
+    for (argv = lastcmd->argv; *argv != NULL; argv++)
+        ;
+    nargv = argv + 1 - ps->argv;
+    size = sizeof(struct pcache_t) + n * sizeof(struct pipeline_t) +
+           ncmds * sizeof(struct cmd_t) + nredirs * sizeof(struct redir_t) +
+           nargv * sizeof(char *) + 2 * (len + 1);
+    if (size > PCACHEMEM / 16)
+        return NULL;
+
+    for (victim = pcache_lru; victim != NULL && pcache_bytes + size > PCACHEMEM; ) {
+        pc = victim;
+        victim = victim->newer;
+        if (pc->busy == 0) {
+            pcache_unlink(pc);
+            pcache_evictions++;
+        }
+    }
+    if (pcache_bytes + size > PCACHEMEM || (pc = malloc(size)) == NULL)
+        return NULL;
+
+    pc->pipes = (struct pipeline_t *)(pc + 1);
+    cmds = (struct cmd_t *)(pc->pipes + n);
+    redirs = (struct redir_t *)(cmds + ncmds);
+    argv = (char **)(redirs + nredirs);
+    pc->line = (char *)(argv + nargv);
+    text = pc->line + len + 1;
+    memcpy(pc->line, cmdline, len + 1);
+    memcpy(text, ps->text, len + 1);
+    memcpy(pc->pipes, ps->pipes, n * sizeof(struct pipeline_t));
+    memcpy(cmds, ps->cmds, ncmds * sizeof(struct cmd_t));
+    memcpy(redirs, ps->redirs, nredirs * sizeof(struct redir_t));
+    for (i = 0; i < n; i++) {
+        pc->pipes[i].cmds = cmds + (pc->pipes[i].cmds - ps->cmds);
+        if (pc->pipes[i].node != NULL)
+            pc->pipes[i].node = text + (pc->pipes[i].node - ps->text);
+    }
+    for (i = 0; i < ncmds; i++) {
+        cmds[i].argv = argv + (cmds[i].argv - ps->argv);
+        cmds[i].redirs = redirs + (cmds[i].redirs - ps->redirs);
+    }
+    for (i = 0; i < nredirs; i++) {
+        if (redirs[i].path != NULL)
+            redirs[i].path = text + (redirs[i].path - ps->text);
+    }
+    for (i = 0; i < nargv; i++)
+        argv[i] = ps->argv[i] ? text + (ps->argv[i] - ps->text) : NULL;
+
+    pc->hash = hash;
+    pc->npipes = n;
+    pc->size = size;
+    pc->busy = 0;
+    pp = &pcache[hash % PCACHESIZE];
+    pc->next = *pp;
+    *pp = pc;
+    pc->newer = NULL;
+    pc->older = pcache_mru;
+    if (pcache_mru != NULL)
+        pcache_mru->newer = pc;
+    else
+        pcache_lru = pc;
+    pcache_mru = pc;
+    pcache_bytes += size;
+    return pc;
+}
+
+/* pcache_unlink - Drop pc from the cache and free it */
+void pcache_unlink(struct pcache_t *pc) {
+    struct pcache_t **pp;
+
+    for (pp = &pcache[pc->hash % PCACHESIZE]; *pp != pc; pp = &(*pp)->next)
+        ;
+    *pp = pc->next;
+    if (pc->newer != NULL)
+        pc->newer->older = pc->older;
+    else
+        pcache_mru = pc->older;
+    if (pc->older != NULL)
+        pc->older->newer = pc->newer;
+    else
+        pcache_lru = pc->newer;
+    pcache_bytes -= pc->size;
+    free(pc);
+}
+
+
+/******************************************************
+ * Helper routines for the worker pool
+ ******************************************************/
+
+/*
+ * With -Z n the shell keeps n zygotes: children forked ahead of time,
+ * each in its own process group with a clean signal state, blocked
+ * reading a socketpair. pool_spawn() sends one of them an argv,
+ * descriptors, a process group and maybe a cgroup to join, and it
+ * execs at once, so the fork
+ * is paid while the shell would otherwise be idle. A used worker is
+ * an ordinary job process from then on; idle ones are kept out of the
+ * job table and are replaced by pool_fill() before the shell blocks.
+ */
+
+/* pool_fill - Fork zygotes until poolsize of them are ready */
+void pool_fill(void) {
+    int sv[2];
+    pid_t pid;
+
+    // A builtin may have stdio redirected; a worker would keep it open
+    if (stdio_moved)
+        return;
+    while (npool < poolsize) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+            unix_error("socketpair error");
+        if ((pid = fork()) < 0)
+            unix_error("fork error");
+        if (pid == 0) { // Child process
+            close(sv[0]);
+            zygote(sv[1]);
+        }
+        close(sv[1]);
+        setpgid(pid, pid); // Don't race the worker's own setpgid()
+        pool[npool].pid = pid;
+        pool[npool].sock = sv[0];
+        npool++;
+    }
+}
+
+/*
+ * zygote - Body of a pool worker: wait for one command on sock, set
+ *    it up and exec it. A failed exec is reported back as an errno;
+ *    a successful one closes the socket.
+ */
+void zygote(int sock) {
+    static char buf[ZYGOTEMSG];
+    char cbuf[CMSG_SPACE(ZYGOTEFDS * sizeof(int))];
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct zreq_t req;
+    int fds[ZYGOTEFDS], nfds = 0, err, fd, i;
+    char **argv, *path, *p;
+    ssize_t n;
+
+    outq.head = outq.tail; // The shell's pending output is not ours
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    setpgid(0, 0);
+
+    // Keep stdio and the socket (as fd 3) and nothing else of the shell's
+    if (sock != 3) {
+        dup3(sock, 3, O_CLOEXEC);
+        sock = 3;
+    }
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 4, ~0U, 0) < 0)
+#endif
+        for (fd = 4; fd < 1024; fd++)
+            close(fd);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n < (ssize_t)sizeof(req))
+        _exit(0); // The shell has gone
+    memcpy(&req, buf, sizeof(req));
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+        }
+    }
+
+    // Join the job's cgroup before anything of the command runs
+    if (req.cgroup >= 0 && req.cgroup < nfds &&
+        (fd = openat(fds[req.cgroup], "cgroup.procs", O_WRONLY | O_CLOEXEC)) >= 0) {
+        write(fd, "0", 1);
+        close(fd);
+    }
+    if (req.placed) {
+        setaffinity(&req.cpus);
+        if (req.node >= 0)
+            setmempolicy(req.node);
+    }
+    for (i = 0; i < req.nops; i++) {
+        fd = req.ops[i].from;
+        if (fd < 0 && -1 - fd < nfds)
+            fd = fds[-1 - fd];
+        dup2(fd, req.ops[i].to);
+    }
+    if ((argv = malloc((req.argc + 1) * sizeof(char *))) == NULL)
+        _exit(127);
+    p = path = buf + sizeof(req);
+    for (i = 0; i < req.argc; i++)
+        argv[i] = p += strlen(p) + 1;
+    argv[req.argc] = NULL;
+
+    sigprocmask(SIG_SETMASK, &req.mask, NULL);
+    execve(path, argv, environ);
+    if (errno == ENOENT && req.cached)
+        execvp(argv[0], argv);
+    err = errno;
+    write(sock, &err, sizeof(err));
+    _exit(127);
+}
+
+/*
+ * pool_spawn - Start cmd, as spawn_job() would, on an idle worker.
+ *    Returns its pid, 0 if the exec failed, or -1 if no worker could
+ *    take the command, which is then started the usual way.
+ */
+pid_t pool_spawn(struct cmd_t *cmd, char *path, int cached, const sigset_t *mask,
+                 pid_t pgid, int infd, int outfd, int cgfd) {
+    static char buf[ZYGOTEMSG];
+    char cbuf[CMSG_SPACE(ZYGOTEFDS * sizeof(int))];
+    struct iovec iov = { buf, 0 };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct zygote_t z;
+    struct zreq_t req;
+    struct redir_t *r;
+    int fds[ZYGOTEFDS], nfds = 0, err, i;
+    size_t len = sizeof(req), k;
+    ssize_t n;
+
+    memset(&req, 0, sizeof(req));
+    req.mask = *mask;
+    req.cached = cached;
+    req.cgroup = -1;
+    if (placer.held) { // The worker doesn't inherit the shell's placement
+        req.placed = 1;
+        req.cpus = placer.cur;
+        req.node = placer.curnode;
+    }
+    if (cmd->nredirs + 3 > ZYGOTEFDS)
+        return -1;
+    if (cgfd >= 0) {
+        fds[nfds] = cgfd;
+        req.cgroup = nfds++;
+    }
+    if (infd >= 0) {
+        fds[nfds] = infd;
+        req.ops[req.nops].from = -1 - nfds++;
+        req.ops[req.nops++].to = STDIN_FILENO;
+    }
+    if (outfd >= 0) {
+        fds[nfds] = outfd;
+        req.ops[req.nops].from = -1 - nfds++;
+        req.ops[req.nops++].to = STDOUT_FILENO;
+    }
+    for (r = cmd->redirs; r < cmd->redirs + cmd->nredirs; r++) {
+        // Either could be the worker's socket: only 0-2 are the same there
+        if (r->fd > 2 || (r->op == R_DUP && r->dupfd > 2))
+            return -1;
+        if (r->op == R_DUP) {
+            req.ops[req.nops].from = r->dupfd;
+        } else {
+            fds[nfds] = r->ofd;
+            req.ops[req.nops].from = -1 - nfds++;
+        }
+        req.ops[req.nops++].to = r->fd;
+    }
+
+    // path, then the arguments, each NUL-terminated
+    for (i = -1; i < 0 || cmd->argv[i] != NULL; i++) {
+        k = strlen(i < 0 ? path : cmd->argv[i]) + 1;
+        if (len + k > sizeof(buf))
+            return -1;
+        memcpy(buf + len, i < 0 ? path : cmd->argv[i], k);
+        len += k;
+    }
+    req.argc = i;
+    memcpy(buf, &req, sizeof(req));
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+
+    while (npool > 0) {
+        z = pool[--npool];
+        setpgid(z.pid, pgid ? pgid : z.pid);
+        if (sendmsg(z.sock, &msg, MSG_NOSIGNAL) < 0) {
+            // It died while idle, so it is still ours to reap
+            close(z.sock);
+            kill(z.pid, SIGKILL);
+            reapchild(z.pid);
+            continue;
+        }
+        while ((n = read(z.sock, &err, sizeof(err))) < 0 && errno == EINTR)
+            ;
+        close(z.sock);
+        if (n > 0) {
+            // As with posix_spawn(), a failed exec creates no job
+            reapchild(z.pid);
+            outflush();
+            fprintf(stderr, "%s: Command not found\n", cmd->argv[0]);
+            stats.spawnfails++;
+            last_status = 127;
+            return 0;
+        }
+        stats.pooled++;
+        return z.pid;
+    }
+    return -1;
+}
+
+/*
+ * pool_reaped - Child pid, which is in no job, changed state: if it's
+ *    an idle worker that died, drop it from the pool. Returns 1 if
+ *    pid is (or was) a worker.
+ */
+int pool_reaped(pid_t pid, int code) {
+    int i;
+
+    for (i = 0; i < npool; i++) {
+        if (pool[i].pid == pid) {
+            if (code == CLD_EXITED || code == CLD_KILLED || code == CLD_DUMPED) {
+                close(pool[i].sock);
+                pool[i] = pool[--npool];
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/******************************************************
+ * Helper routines for the io_uring event loop
+ ******************************************************/
+
+/*
+ * With -U the event loop sleeps in io_uring_enter() on one ring that
+ * has a waitid on all children, a read of the signal descriptor, the
+ * write of pending output and, at the prompt, the read of the next
+ * input all in flight at once: arming what has completed and waiting
+ * for the next completion is a single system call. The waitid is made
+ * with WNOWAIT, so the child is then reaped by pid with wait4(), which
+ * also gives its resource usage. Completions are only recorded by
+ * uring_reap(), which is safe anywhere, and acted upon in uring_wait().
+ */
+
+#if HAVE_URING
+/* uring_sqe - A cleared submission entry, queued for the next enter */
+static struct io_uring_sqe *uring_sqe(int op, int fd, uint64_t tag) {
+    unsigned tail = *ring.sqtail, i = tail & *ring.sqmask;
+    struct io_uring_sqe *sqe = &ring.sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    ring.sqarray[i] = i;
+    __atomic_store_n(ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return sqe;
+}
+
+/* uring_enter - Submit what is queued and wait for want completions */
+static int uring_enter(unsigned want, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = want > 0 ? IORING_ENTER_GETEVENTS : 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    int n;
+
+    if (want > 0 && timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    n = syscall(SYS_io_uring_enter, ring.fd, ring.queued, want, flags, argp, argsz);
+    if (n > 0)
+        ring.queued -= n;
+    if (n < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+        unix_error("io_uring_enter error");
+    return n;
+}
+#endif
+
+/*
+ * uring_init - Set up the ring for -U. Returns 0 (and the shell keeps
+ *    using poll()) if the kernel can't give io_uring with waitid.
+ */
+int uring_init(void) {
+#if HAVE_URING
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t size;
+    char *sq;
+    int fd, ok;
+#if USE_SIGNALFD
+    sigset_t mask;
+#endif
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(SYS_io_uring_setup, URINGDEPTH, &p)) < 0)
+        return 0;
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    ok = probe != NULL && (p.features & IORING_FEAT_SINGLE_MMAP) &&
+         syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+         probe->last_op >= URING_OP_WAITID &&
+         (probe->ops[URING_OP_WAITID].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) {
+        close(fd);
+        return 0;
+    }
+
+    // One mapping for both rings, one for the submission entries
+    size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || ring.sqes == MAP_FAILED)
+        unix_error("io_uring mmap error");
+    ring.fd = fd;
+    ring.sqhead = (unsigned *)(sq + p.sq_off.head);
+    ring.sqtail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sqarray = (unsigned *)(sq + p.sq_off.array);
+    ring.cqhead = (unsigned *)(sq + p.cq_off.head);
+    ring.cqtail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cqmask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    // The ring waits on the signal descriptor itself, which must block
+    // for that; exits come from the waitid, not from SIGCHLD
+#if USE_SIGNALFD
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGUSR2);
+    signalfd(sig_fd, &mask, 0);
+#endif
+    fcntl(sig_fd, F_SETFL, fcntl(sig_fd, F_GETFL) & ~O_NONBLOCK);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * uring_reap - Record every completion on the ring. Nothing is acted
+ *    upon here but the output ring, so this may run from anywhere.
+ */
+void uring_reap(void) {
+#if HAVE_URING
+    unsigned head = *ring.cqhead, out;
+    struct io_uring_cqe *cqe;
+
+    while (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring.cqes[head & *ring.cqmask];
+        switch (cqe->user_data) {
+            case UR_WAITID:
+                ring.waitid = 2;
+                ring.waitres = cqe->res;
+                break;
+            case UR_SIGNAL:
+                ring.sigread = 2;
+                ring.sigres = cqe->res;
+                break;
+            case UR_WRITE:
+                // Output nobody will take is dropped, as by outflush()
+                if (cqe->res > 0)
+                    out = outq.head + cqe->res;
+                else
+                    out = __atomic_load_n(&outq.tail, __ATOMIC_ACQUIRE);
+                __atomic_store_n(&outq.head, out, __ATOMIC_RELEASE);
+                ring.writing = 0;
+                break;
+            case UR_READ:
+                ring.reading = 0;
+                ring.readres = cqe->res;
+                break;
+        }
+        head++;
+    }
+    __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+#endif
+}
+
+/* uring_flushwait - Wait until no output is being written by the ring */
+void uring_flushwait(void) {
+#if HAVE_URING
+    while (ring.writing) {
+        uring_enter(1, -1);
+        uring_reap();
+    }
+#endif
+}
+
+/*
+ * uring_wait - wait_events() on the ring: arm whatever isn't in
+ *    flight, sleep until something completes (for up to timeout ms, -1
+ *    being forever, 0 not at all) and dispatch it
+ */
+int uring_wait(int timeout) {
+#if HAVE_URING
+    struct io_uring_sqe *sqe;
+    struct rusage ru;
+    unsigned int head, tail, k;
+    uint64_t reaped;
+    pid_t pid;
+    int status;
+
+    timeout = captick(timeout);
+    // As with poll(): output goes out first, in order at a job
+    // boundary, and the pool is topped up when the shell would block
+    if (timeout == 0) {
+        outflush();
+    } else {
+        if (npool < poolsize)
+            pool_fill();
+        head = outq.head;
+        tail = __atomic_load_n(&outq.tail, __ATOMIC_ACQUIRE);
+        if (!ring.writing && head != tail) {
+            k = tail - head;
+            if (k > OUTBUFSIZE - (head & (OUTBUFSIZE - 1)))
+                k = OUTBUFSIZE - (head & (OUTBUFSIZE - 1));
+            sqe = uring_sqe(IORING_OP_WRITE, STDOUT_FILENO, UR_WRITE);
+            sqe->addr = (uint64_t)(uintptr_t)(outq.buf + (head & (OUTBUFSIZE - 1)));
+            sqe->len = k;
+            sqe->off = (uint64_t)-1;
+            ring.writing = k;
+        }
+    }
+    if (ring.waitid == 0 && jobs->npids + npool > 0) {
+        memset(&ring.si, 0, sizeof(ring.si));
+        sqe = uring_sqe(URING_OP_WAITID, 0, UR_WAITID);
+        sqe->len = P_ALL;
+        sqe->file_index = WEXITED | WSTOPPED | WCONTINUED | WNOWAIT;
+        sqe->addr2 = (uint64_t)(uintptr_t)&ring.si;
+        ring.waitid = 1;
+    }
+    if (ring.sigread == 0) {
+        sqe = uring_sqe(IORING_OP_READ, sig_fd, UR_SIGNAL);
+#if USE_SIGNALFD
+        sqe->addr = (uint64_t)(uintptr_t)&ring.ssi;
+        sqe->len = sizeof(ring.ssi);
+#else
+        sqe->addr = (uint64_t)(uintptr_t)&ring.sigbyte;
+        sqe->len = 1;
+#endif
+        ring.sigread = 1;
+    }
+
+    // Nothing to hand over and nothing to wait for costs no call at all
+    if (timeout != 0 || ring.queued > 0)
+        uring_enter(timeout != 0, timeout);
+    uring_reap();
+
+    if (ring.sigread == 2) {
+        ring.sigread = 0;
+#if USE_SIGNALFD
+        int sig = ring.sigres == sizeof(ring.ssi) ? (int)ring.ssi.ssi_signo : 0;
+        if (sig != 0 && sig != SIGCHLD)
+            eventsig(sig);
+#endif
+    }
+    evq_drain();        // The handler leaves the children to the waitid below
+    if (ring.waitid == 2) {
+        ring.waitid = 0;
+        if (ring.waitres == 0 && (pid = ring.si.si_pid) > 0) {
+            stats.sigchld++;
+            if (wait4(pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru) == pid) {
+                reaped = stats.reaps;
+                waitstatus(pid, status, &ru);
+                histadd(&stats.sweep, stats.reaps - reaped);
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+/*
+ * uring_read - read(2) through the ring, running the event loop until
+ *    the read completes
+ */
+ssize_t uring_read(int fd, void *buf, size_t n) {
+#if HAVE_URING
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(IORING_OP_READ, fd, UR_READ);
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = n;
+    sqe->off = (uint64_t)-1; // At the file position, as read(2) is
+    ring.reading = 1;
+    while (ring.reading)
+        uring_wait(-1);
+    if (ring.readres < 0) {
+        errno = -ring.readres;
+        return -1;
+    }
+    return ring.readres;
+#else
+    return read(fd, buf, n);
+#endif
+}
+
+/******************************************************
+ * Helper routines for the dag builtin
+ ******************************************************/
+
+/*
+ * dag runs the targets of a file of lines
+ *
+ *    target: dep dep ... ; command line
+ *
+ * as background jobs, each one as soon as the targets it depends on
+ * have succeeded and a job slot is free, so independent work never
+ * waits on a stage boundary. A target without a command only groups
+ * its dependencies. Blank lines and lines starting with # are
+ * skipped. When a target fails for good, every target that needs it
+ * is skipped and the rest carry on.
+ */
+
+/* dagfind - Index of the target called name in d, or -1 */
+int dagfind(struct dag_t *d, const char *name) {
+    int i;
+
+    for (i = d->bucket[strhash(name) & (d->nbuckets - 1)]; i >= 0; i = d->nodes[i].chain)
+        if (strcmp(d->nodes[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+/* dagcmd - Parse the command of node into ps; its pipeline, or NULL */
+struct pipeline_t *dagcmd(struct dag_t *d, struct dagnode_t *node, struct parse_t *ps) {
+    struct pipeline_t *pl;
+    int n, i;
+
+    if ((n = parseline(node->cmd, ps)) <= 0)
+        return NULL; // Reported by parseline()
+    pl = ps->pipes;
+    if (n == 1 && !pl->bg && pl->node == NULL) {
+        for (i = 0; i < pl->ncmds && !isbuiltin(pl->cmds[i].argv[0]); i++)
+            ;
+        if (i == pl->ncmds)
+            return pl;
+    }
+    outprintf("dag: %s:%d: the command must be one pipeline of programs\n", d->file, node->line);
+    return NULL;
+}
+
+/*
+ * dagline - Add the target on line (lineno of the file) to d.
+ *    Returns -1 after reporting what is wrong with it.
+ */
+int dagline(struct dag_t *d, const char *line, int lineno, struct parse_t *ps) {
+    struct dagnode_t *node;
+    char *p, *q, *e;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line == '\0' || *line == '#')
+        return 0;
+    d->nodes = growarray(d->nodes, &d->cap, d->n + 1, sizeof(*d->nodes));
+    node = &d->nodes[d->n++];
+    memset(node, 0, sizeof(*node));
+    node->line = lineno;
+    if ((p = node->text = strdup(line)) == NULL)
+        unix_error("dag: strdup error");
+
+    if ((q = strchr(p, ':')) == NULL) {
+        outprintf("dag: %s:%d: missing ':' after the target\n", d->file, lineno);
+        return -1;
+    }
+    for (e = q; e > p && (e[-1] == ' ' || e[-1] == '\t'); e--)
+        ;
+    *e = '\0';
+    if (*p == '\0' || strpbrk(p, " \t") != NULL) {
+        outprintf("dag: %s:%d: the target must be one word\n", d->file, lineno);
+        return -1;
+    }
+    node->name = p;
+    node->depnames = q + 1;
+    if ((q = strchr(q + 1, ';')) != NULL) {
+        *q++ = '\0';
+        while (*q == ' ' || *q == '\t')
+            q++;
+        if (*q != '\0')
+            node->cmd = q;
+    }
+    // Bad commands are caught now rather than halfway through the run
+    if (node->cmd != NULL && dagcmd(d, node, ps) == NULL)
+        return -1;
+    return 0;
+}
+
+/*
+ * dagload - Read the targets of file into d and link each one to the
+ *    targets it needs and to those that need it. Returns -1 after
+ *    reporting the first problem.
+ */
+int dagload(struct dag_t *d, const char *file, struct parse_t *ps) {
+    struct reader_t rd;
+    struct dagnode_t *node, *dep;
+    char *line, *p, *e;
+    int fd, i, j, k, lineno = 0, err = 0;
+
+    memset(d, 0, sizeof(*d));
+    d->file = file;
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+        outprintf("%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    initreader(&rd, fd, INBUFSIZE);
+    while (err == 0 && (line = readline_fd(&rd)) != NULL)
+        err = dagline(d, line, ++lineno, ps);
+    free(rd.buf);
+    close(fd);
+    if (err < 0)
+        return -1;
+
+    for (d->nbuckets = 16; d->nbuckets < 2 * d->n; d->nbuckets *= 2)
+        ;
+    if ((d->bucket = malloc(d->nbuckets * sizeof(int))) == NULL)
+        unix_error("dag: malloc error");
+    memset(d->bucket, -1, d->nbuckets * sizeof(int));
+    for (i = 0; i < d->n; i++) {
+        node = &d->nodes[i];
+        if (dagfind(d, node->name) >= 0) {
+            outprintf("dag: %s:%d: target '%s' is defined twice\n", file, node->line, node->name);
+            return -1;
+        }
+        k = strhash(node->name) & (d->nbuckets - 1);
+        node->chain = d->bucket[k];
+        d->bucket[k] = i;
+    }
+
+    for (i = 0; i < d->n; i++) {
+        node = &d->nodes[i];
+        for (p = node->depnames; ; p = e) {
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == '\0')
+                break;
+            for (e = p; *e != '\0' && *e != ' ' && *e != '\t'; e++)
+                ;
+            if (*e != '\0')
+                *e++ = '\0';
+            if ((j = dagfind(d, p)) < 0) {
+                outprintf("dag: %s:%d: no target '%s'\n", file, node->line, p);
+                return -1;
+            }
+            dep = &d->nodes[j];
+            node->deps = growarray(node->deps, &node->depcap, node->ndeps + 1, sizeof(int));
+            node->deps[node->ndeps++] = j;
+            dep->users = growarray(dep->users, &dep->usercap, dep->nusers + 1, sizeof(int));
+            dep->users[dep->nusers++] = i;
+        }
+    }
+    return 0;
+}
+
+/*
+ * dagplan - Mark the targets the run needs: those named in targets
+ *    (all of them if there are none) and everything they depend on.
+ *    Counts the deps each has to wait for and queues those that can
+ *    start. Returns -1 after reporting a cycle.
+ */
+int dagplan(struct dag_t *d, char **targets) {
+    int *stack, *waiting, i, j, k, n = 0, done = 0;
+
+    if ((stack = malloc(d->n * sizeof(int))) == NULL ||
+        (waiting = malloc(d->n * sizeof(int))) == NULL ||
+        (d->queue = malloc(d->n * sizeof(int))) == NULL)
+        unix_error("dag: malloc error");
+    for (i = 0; targets[i] != NULL; i++) {
+        if ((j = dagfind(d, targets[i])) < 0) {
+            outprintf("dag: no target '%s'\n", targets[i]);
+            free(stack);
+            free(waiting);
+            return -1;
+        }
+        if (!d->nodes[j].needed) {
+            d->nodes[j].needed = 1;
+            stack[n++] = j;
+        }
+    }
+    if (targets[0] == NULL) {
+        for (j = 0; j < d->n; j++)
+            d->nodes[j].needed = 1;
+    } else {
+        while (n > 0) {
+            j = stack[--n];
+            for (k = 0; k < d->nodes[j].ndeps; k++) {
+                i = d->nodes[j].deps[k];
+                if (!d->nodes[i].needed) {
+                    d->nodes[i].needed = 1;
+                    stack[n++] = i;
+                }
+            }
+        }
+    }
+
+    // Order the needed targets once on the side: what is left is a cycle
+    for (j = 0; j < d->n; j++) {
+        if (!d->nodes[j].needed)
+            continue;
+        d->nneeded++;
+        waiting[j] = d->nodes[j].waiting = d->nodes[j].ndeps;
+        if (waiting[j] == 0) {
+            stack[n++] = j;
+            d->queue[d->qtail++] = j;
+        }
+    }
+    while (n > 0) {
+        j = stack[--n];
+        done++;
+        for (k = 0; k < d->nodes[j].nusers; k++) {
+            i = d->nodes[j].users[k];
+            if (d->nodes[i].needed && --waiting[i] == 0)
+                stack[n++] = i;
+        }
+    }
+    if (done < d->nneeded) {
+        for (j = 0; !d->nodes[j].needed || waiting[j] == 0; j++)
+            ;
+        outprintf("dag: %s:%d: '%s' is on a dependency cycle\n", d->file, d->nodes[j].line, d->nodes[j].name);
+    }
+    free(stack);
+    free(waiting);
+    return done < d->nneeded ? -1 : 0;
+}
+
+/* dagskip - Skip every target that needs node i, which failed */
+int dagskip(struct dag_t *d, int i) {
+    int *stack, n = 0, skipped = 0, j, k;
+
+    if ((stack = malloc(d->n * sizeof(int))) == NULL)
+        unix_error("dag: malloc error");
+    stack[n++] = i;
+    while (n > 0) {
+        j = stack[--n];
+        for (k = 0; k < d->nodes[j].nusers; k++) {
+            i = d->nodes[j].users[k];
+            if (d->nodes[i].needed && d->nodes[i].state == DN_WAIT) {
+                d->nodes[i].state = DN_SKIPPED;
+                stack[n++] = i;
+                skipped++;
+            }
+        }
+    }
+    free(stack);
+    return skipped;
+}
+
+/*
+ * dagdone - Target i has finished, with its command's status in code
+ *    and value: queue what was waiting on it, or retry or give up
+ */
+void dagdone(struct dag_t *d, int i, int code, int value) {
+    struct dagnode_t *node = &d->nodes[i], *user;
+    char status[32];
+    int k, n;
+
+    if (code == CLD_EXITED && value == 0) {
+        node->state = DN_DONE;
+        d->ndone++;
+        for (k = 0; k < node->nusers; k++) {
+            user = &d->nodes[node->users[k]];
+            if (user->needed && --user->waiting == 0 && user->state == DN_WAIT)
+                d->queue[d->qtail++ % d->n] = node->users[k];
+        }
+        return;
+    }
+
+    if (code == CLD_EXITED)
+        snprintf(status, sizeof(status), "exit status %d", value);
+    else if (code == CLD_KILLED)
+        snprintf(status, sizeof(status), "signal %d", value);
+    else
+        strcpy(status, "not started");
+    if (node->tries <= d->retries && !d->stop) {
+        outprintf("dag: %s failed (%s), retrying\n", node->name, status);
+        node->state = DN_WAIT;
+        d->queue[d->qtail++ % d->n] = i;
+        return;
+    }
+    node->state = DN_FAILED;
+    d->nfailed++;
+    n = dagskip(d, i);
+    d->nskipped += n;
+    if (n > 0)
+        outprintf("dag: %s failed (%s), skipping %d target%s that need%s it\n",
+                  node->name, status, n, n == 1 ? "" : "s", n == 1 ? "s" : "");
+    else
+        outprintf("dag: %s failed (%s)\n", node->name, status);
+}
+
+/* dagfree - Release everything held by d */
+void dagfree(struct dag_t *d) {
+    int i;
+
+    for (i = 0; i < d->n; i++) {
+        free(d->nodes[i].text);
+        free(d->nodes[i].deps);
+        free(d->nodes[i].users);
+    }
+    free(d->nodes);
+    free(d->bucket);
+    free(d->queue);
+}
+
+/*
+ * do_dag - Execute the builtin dag command:
+ *
+ *    dag [-j N] [-r N] file [target...]
+ *
+ *    Runs the named targets of file (all of them by default) and the
+ *    targets they need, keeping at most N jobs (the number of online
+ *    CPUs by default) running. A failed command is run again up to
+ *    -r times before its target counts as failed.
+ */
+void do_dag(char **argv) {
+    static struct parse_t ps; // Not eval()'s: that one holds our own line
+    struct dag_t d;
+    struct dagnode_t *node;
+    struct pipeline_t *pl;
+    struct job_t *job;
+    int *running, i, k, nrunning = 0, retries = 0;
+    long maxjobs = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t pid;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && argv[i + 1] != NULL) {
+            if ((maxjobs = atoi(argv[++i])) <= 0) {
+                outprintf("dag: -j needs a positive count\n");
+                return;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && argv[i + 1] != NULL) {
+            if ((retries = atoi(argv[++i])) < 0) {
+                outprintf("dag: -r needs a count\n");
+                return;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argv[i] == NULL) {
+        outprintf("usage: dag [-j N] [-r N] file [target...]\n");
+        return;
+    }
+    if (maxjobs < 1)
+        maxjobs = 1;
+
+    if (dagload(&d, argv[i], &ps) < 0 || dagplan(&d, &argv[i + 1]) < 0) {
+        dagfree(&d);
+        return;
+    }
+    d.retries = retries;
+    if ((running = malloc(maxjobs * sizeof(int))) == NULL)
+        unix_error("dag: malloc error");
+
+    interrupted = 0;
+    for (;;) {
+        // Collect the jobs that have ended, in the order they did
+        for (k = 0; k < nexits; k++) {
+            for (i = 0; i < nrunning && d.nodes[running[i]].pid != exits[k].pid; i++)
+                ;
+            if (i == nrunning)
+                continue;
+            node = &d.nodes[running[i]];
+            running[i] = running[--nrunning];
+            node->pid = 0;
+            dagdone(&d, node - d.nodes, exits[k].code, exits[k].value);
+        }
+        nexits = 0;
+        if (interrupted) {
+            for (i = 0; i < nrunning; i++)
+                kill(-d.nodes[running[i]].pid, SIGINT);
+            interrupted = 0;
+            d.stop = 1;
+        }
+
+        while (!d.stop && nrunning < maxjobs && d.qhead != d.qtail) {
+            i = d.queue[d.qhead++ % d.n];
+            node = &d.nodes[i];
+            if (node->cmd == NULL) {
+                dagdone(&d, i, CLD_EXITED, 0);
+                continue;
+            }
+            node->tries++;
+            if ((pl = dagcmd(&d, node, &ps)) == NULL ||
+                (pid = startpipeline(pl, 1, node->cmd)) == 0) {
+                dagdone(&d, i, 0, 0);
+                continue;
+            }
+            job = getjobpid(jobs, pid);
+            job->flags |= JOB_WATCH;
+            node->state = DN_RUN;
+            node->pid = pid;
+            running[nrunning++] = i;
+        }
+        if (nrunning == 0)
+            break;
+        wait_events(-1, -1);
+    }
+
+    if (d.ndone < d.nneeded)
+        outprintf("dag: %d of %d targets done, %d failed, %d skipped\n",
+                  d.ndone, d.nneeded, d.nfailed, d.nskipped);
+    free(running);
+    dagfree(&d);
+}
+
+/******************************************************
+ * Helper routines for the command history
+ ******************************************************/
+
+/*
+ * hist_open - Append this shell's command lines to path, or by default
+ *    to $HOME/.tsh_history. The file is only opened here: it is mapped
+ *    and indexed the first time it is searched, so a long history costs
+ *    nothing at startup.
+ */
+void hist_open(const char *path) {
+    char buf[4096];
+    const char *home;
+
+    if (path == NULL) {
+        if ((home = getenv("HOME")) == NULL)
+            return;
+        snprintf(buf, sizeof(buf), "%s/.tsh_history", home);
+        path = buf;
+    }
+    if ((histfile.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0 && verbose)
+        outprintf("%s: %s\n", path, strerror(errno));
+}
+
+/*
+ * hist_record - Add line to the history. The entry and its newline go
+ *    out in one O_APPEND write, so shells sharing the file never
+ *    interleave inside an entry. A line repeating the last one is not
+ *    added again.
+ */
+void hist_record(const char *line) {
+    struct iovec iov[2];
+    size_t n = strlen(line);
+
+    if (line[strspn(line, " \t")] == '\0')
+        return;
+    if (histfile.last != NULL && strcmp(histfile.last, line) == 0)
+        return;
+    free(histfile.last);
+    if ((histfile.last = strdup(line)) == NULL)
+        unix_error("hist_record: strdup error");
+    iov[0].iov_base = (char *)line;
+    iov[0].iov_len = n;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    if (writev(histfile.fd, iov, 2) < 0 && verbose)
+        outprintf("history: %s\n", strerror(errno));
+}
+
+/*
+ * hist_sync - Bring the map up to the end of the file, which other
+ *    shells may have appended to. Only whole lines are taken in; one
+ *    still being written is picked up next time. Returns 0 if the
+ *    history is empty.
+ */
+int hist_sync(void) {
+    struct stat st;
+    const char *nl;
+    size_t len;
+    void *p;
+
+    if (fstat(histfile.fd, &st) < 0)
+        return histfile.size > 0;
+    len = st.st_size;
+    if (len < histfile.size || len > histfile.maplen) {
+        if (histfile.map != NULL)
+            munmap((void *)histfile.map, histfile.maplen);
+        histfile.map = NULL;
+        histfile.maplen = 0;
+        if (len < histfile.size) // Cut short under us: index it again
+            histfile.size = histfile.indexed = histfile.nindex = 0;
+        if (len == 0)
+            return 0;
+
+        // Pages past the end become readable as the file grows into them
+        p = mmap(NULL, len + len / 2 + HISTTAIL, PROT_READ, MAP_SHARED, histfile.fd, 0);
+        if (p == MAP_FAILED) {
+            histfile.size = histfile.indexed = histfile.nindex = 0;
+            return 0;
+        }
+        histfile.map = p;
+        histfile.maplen = len + len / 2 + HISTTAIL;
+    }
+    if (len > histfile.size &&
+        (nl = memrchr(histfile.map + histfile.size, '\n', len - histfile.size)) != NULL)
+        histfile.size = nl + 1 - histfile.map;
+    return histfile.size > 0;
+}
+
+/* offcmp - qsort() order of offsets */
+static int offcmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* histchar - A byte of an entry for ordering, the end of it lowest */
+static inline int histchar(const char *p) {
+    return *p == '\n' ? -1 : (unsigned char)*p;
+}
+
+/* hist_cmp - qsort() order of entry offsets: by text, then by age */
+static int hist_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    const char *p = histfile.map + x, *q = histfile.map + y;
+
+    while (*p == *q && *p != '\n')
+        p++, q++;
+    if (*p != *q)
+        return histchar(p) - histchar(q);
+    return offcmp(a, b);
+}
+
+/* hist_prefix - Order of the entry at off against the prefix s, 0 if it has it */
+static int hist_prefix(uint64_t off, const char *s, size_t len) {
+    const char *p = histfile.map + off;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (p[i] != s[i])
+            return histchar(p + i) < (unsigned char)s[i] ? -1 : 1;
+    return 0;
+}
+
+/*
+ * hist_reindex - Sort every entry seen so far by its text. Entries
+ *    sharing a prefix then form one run of index[], and newest[] finds
+ *    the most recent of any run in O(log n). Entries appended later are
+ *    searched linearly until they outgrow HISTTAIL and an eighth of the
+ *    index, so the sort is paid for once, not once per command.
+ */
+void hist_reindex(void) {
+    const char *map = histfile.map, *end = map + histfile.size, *p;
+    size_t n = 0, i;
+
+    for (p = map; p < end; p = (const char *)memchr(p, '\n', end - p) + 1)
+        n++;
+    free(histfile.index);
+    free(histfile.newest);
+    histfile.index = malloc((n + 1) * sizeof(uint64_t));
+    histfile.newest = malloc((2 * n + 1) * sizeof(uint64_t));
+    if (histfile.index == NULL || histfile.newest == NULL)
+        unix_error("hist_reindex: malloc error");
+    for (i = 0, p = map; i < n; i++, p = (const char *)memchr(p, '\n', end - p) + 1)
+        histfile.index[i] = p - map;
+    qsort(histfile.index, n, sizeof(uint64_t), hist_cmp);
+
+    // Leaves at newest[n + i], each parent the larger of its two children
+    for (i = 0; i < n; i++)
+        histfile.newest[n + i] = histfile.index[i];
+    for (i = n - 1; i > 0 && i < n; i--)
+        histfile.newest[i] = histfile.newest[2 * i] > histfile.newest[2 * i + 1] ?
+                             histfile.newest[2 * i] : histfile.newest[2 * i + 1];
+    histfile.nindex = n;
+    histfile.indexed = histfile.size;
+}
+
+/* hist_range - The run [lo, hi) of index[] whose entries start with s */
+void hist_range(const char *s, size_t len, size_t *lo, size_t *hi) {
+    size_t l = 0, h = histfile.nindex, m;
+
+    while (l < h) {
+        m = l + (h - l) / 2;
+        if (hist_prefix(histfile.index[m], s, len) < 0)
+            l = m + 1;
+        else
+            h = m;
+    }
+    *lo = l;
+    for (h = histfile.nindex; l < h; ) {
+        m = l + (h - l) / 2;
+        if (hist_prefix(histfile.index[m], s, len) <= 0)
+            l = m + 1;
+        else
+            h = m;
+    }
+    *hi = l;
+}
+
+/* hist_fresh - Sync with the file, reindexing if too much is unindexed */
+static int hist_fresh(void) {
+    if (!hist_sync())
+        return 0;
+    if (histfile.size - histfile.indexed > HISTTAIL + histfile.indexed / 8)
+        hist_reindex();
+    return 1;
+}
+
+/*
+ * hist_latest - The most recent entry starting with s, and its length
+ *    in *n, or NULL. The unindexed tail is newer than anything in the
+ *    index, so it is searched first, from its end.
+ */
+const char *hist_latest(const char *s, size_t len, size_t *n) {
+    const char *map, *nl;
+    size_t start, end, lo, hi, l, h;
+    uint64_t best = 0;
+
+    if (!hist_fresh())
+        return NULL;
+    map = histfile.map;
+    for (end = histfile.size; end > histfile.indexed; end = start) {
+        nl = memrchr(map + histfile.indexed, '\n', end - 1 - histfile.indexed);
+        start = nl != NULL ? (size_t)(nl + 1 - map) : histfile.indexed;
+        if (hist_prefix(start, s, len) == 0) {
+            *n = end - 1 - start;
+            return map + start;
+        }
+    }
+
+    hist_range(s, len, &lo, &hi);
+    if (lo == hi)
+        return NULL;
+    for (l = lo + histfile.nindex, h = hi + histfile.nindex; l < h; l /= 2, h /= 2) {
+        if ((l & 1) && histfile.newest[l++] > best)
+            best = histfile.newest[l - 1];
+        if ((h & 1) && histfile.newest[--h] > best)
+            best = histfile.newest[h];
+    }
+    *n = (const char *)memchr(map + best, '\n', histfile.size - best) - (map + best);
+    return map + best;
+}
+
+/*
+ * hist_expand - Replace each !! (the previous line) and !prefix (the
+ *    latest entry starting with prefix) that begins a word outside
+ *    quotes. Returns line itself if it has none, else the expansion,
+ *    which is echoed and stays valid until the next call; NULL if an
+ *    entry is not found.
+ */
+char *hist_expand(char *line) {
+    static char *buf = NULL;
+    static int cap = 0;
+    const char *ent;
+    char quote = 0;
+    size_t n;
+    int len = 0, i, j, changed = 0;
+
+    if (strchr(line, '!') == NULL)
+        return line;
+    for (i = 0; line[i] != '\0'; i = j) {
+        j = i + 1;
+        if (quote == 0 && line[i] == '\\' && line[j] != '\0') {
+            j++;
+        } else if (line[i] == '\'' || line[i] == '"') {
+            quote = quote == 0 ? line[i] : quote == line[i] ? 0 : quote;
+        } else if (quote == 0 && line[i] == '!' &&
+                   (i == 0 || charclass[(unsigned char)line[i - 1]] == CC_DELIM) &&
+                   strchr(" \t\n=(", line[j]) == NULL) {
+            // As in bash, ! before a blank, = or ( or at the end is itself
+            // (strchr() finds the NUL too)
+            if (line[j] == '!') {
+                j++;
+                ent = histfile.last;
+                n = ent != NULL ? strlen(ent) : 0;
+            } else {
+                while (charclass[(unsigned char)line[j]] == CC_PLAIN && line[j] != '!')
+                    j++;
+                ent = j > i + 1 ? hist_latest(line + i + 1, j - i - 1, &n) : line + i;
+                if (j == i + 1)
+                    n = 1;  // A lone ! is just a character
+            }
+            if (ent == NULL) {
+                outprintf("%.*s: event not found\n", j - i, line + i);
+                return NULL;
+            }
+            buf = growarray(buf, &cap, len + n + 1, 1);
+            memcpy(buf + len, ent, n);
+            len += n;
+            changed |= ent != line + i;
+            continue;
+        }
+        buf = growarray(buf, &cap, len + j - i + 1, 1);
+        memcpy(buf + len, line + i, j - i);
+        len += j - i;
+    }
+    if (!changed)
+        return line;
+    buf[len] = '\0';
+    outprintf("%s\n", buf);
+    return buf;
+}
+
+/*
+ * do_history - Execute the builtin history command: list the last n
+ *    entries, all by default, or with -p only those starting with prefix,
+ *    found through the index rather than by reading the whole file
+ */
+void do_history(char **argv) {
+    static uint64_t *hits = NULL;
+    static int hitcap = 0;
+    const char *map, *p, *nl, *prefix = NULL;
+    size_t start, end, lo, hi, len, i;
+    int count = 0, nhits = 0, k = 1;
+
+    if (argv[k] != NULL && strcmp(argv[k], "-p") == 0) {
+        if ((prefix = argv[k + 1]) == NULL)
+            goto usage;
+        k += 2;
+    }
+    if (argv[k] != NULL && ((count = atoi(argv[k])) <= 0 || argv[k + 1] != NULL))
+        goto usage;
+    if (histfile.fd < 0) {
+        outprintf("history: no history file\n");
+        return;
+    }
+    if (!hist_fresh())
+        return;
+    map = histfile.map;
+
+    if (prefix == NULL || *prefix == '\0') {
+        for (start = count > 0 ? histfile.size : 0; start > 0 && count-- > 0; ) {
+            nl = start > 1 ? memrchr(map, '\n', start - 1) : NULL;
+            start = nl != NULL ? (size_t)(nl + 1 - map) : 0;
+        }
+        outwrite(map + start, histfile.size - start);
+        return;
+    }
+
+    // Matches from the index, put back in order, then the newer ones
+    // from the tail, which are in order already
+    len = strlen(prefix);
+    hist_range(prefix, len, &lo, &hi);
+    hits = growarray(hits, &hitcap, (int)(hi - lo), sizeof(*hits));
+    for (i = lo; i < hi; i++)
+        hits[nhits++] = histfile.index[i];
+    qsort(hits, nhits, sizeof(*hits), offcmp);
+    for (p = map + histfile.indexed; p < map + histfile.size; p = nl + 1) {
+        nl = memchr(p, '\n', map + histfile.size - p);
+        if (hist_prefix(p - map, prefix, len) == 0) {
+            hits = growarray(hits, &hitcap, nhits + 1, sizeof(*hits));
+            hits[nhits++] = p - map;
+        }
+    }
+    for (i = count > 0 && count < nhits ? nhits - count : 0; i < (size_t)nhits; i++) {
+        end = (const char *)memchr(map + hits[i], '\n', histfile.size - hits[i]) + 1 - map;
+        outwrite(map + hits[i], end - hits[i]);
+    }
+    return;
+
+usage:
+    outprintf("usage: history [-p prefix] [n]\n");
+}
+
+/******************************************************
+ * Helper routines for output capture
+ ******************************************************/
+
+/*
+ * capopen - A new log for a job started with capture. It is a memfd,
+ *    so the job's processes write into shared memory at full speed,
+ *    with no terminal and no shell in their way. Returns -1 if there
+ *    is none to be had, and the job then writes where it would anyway.
+ */
+int capopen(void) {
+    int fd = -1;
+
+#ifdef __linux__
+    if ((fd = memfd_create("tsh-capture", MFD_CLOEXEC)) >= 0)
+        fcntl(fd, F_SETFL, O_APPEND); // The job's writers share one end
+#endif
+    if (fd < 0)
+        outprintf("capture: %s\n", strerror(errno));
+    return fd;
+}
+
+/*
+ * capcmd - cmd with its stderr, and its stdout if it is the last
+ *    stage, sent to the log fd. These come ahead of its own
+ *    redirections, so 2>&1 or > file still win. The copy stays valid
+ *    until the next call.
+ */
+struct cmd_t *capcmd(struct cmd_t *cmd, int fd, int last) {
+    static struct cmd_t copy;
+    static struct redir_t *redirs = NULL;
+    static int redircap = 0;
+    int n = 0;
+
+    redirs = growarray(redirs, &redircap, cmd->nredirs + 2, sizeof(*redirs));
+    redirs[n++] = (struct redir_t){ R_APPEND, STDERR_FILENO, 0, NULL, fd };
+    if (last)
+        redirs[n++] = (struct redir_t){ R_APPEND, STDOUT_FILENO, 0, NULL, fd };
+    memcpy(redirs + n, cmd->redirs, cmd->nredirs * sizeof(*redirs));
+    copy.argv = cmd->argv;
+    copy.redirs = redirs;
+    copy.nredirs = n + cmd->nredirs;
+    return &copy;
+}
+
+/* capadd - Keep fd as the log of job, in place of any older one for its jid */
+void capadd(struct job_t *job, int fd) {
+    struct capture_t *c = capfind(job->jid);
+
+    if (c != NULL) {
+        close(c->fd);
+        free(c->cmdline);
+    } else {
+        captures = growarray(captures, &capturecap, ncaptures + 1, sizeof(*captures));
+        c = &captures[ncaptures++];
+    }
+    c->jid = job->jid;
+    c->pid = job->pid;
+    if ((c->cmdline = strdup(job->cmdline)) == NULL)
+        unix_error("capadd: strdup error");
+    c->fd = fd;
+    c->start = 0;
+}
+
+/* capfind - The log of the latest captured job with jid, or NULL */
+struct capture_t *capfind(int jid) {
+    int i;
+
+    for (i = 0; i < ncaptures; i++)
+        if (captures[i].jid == jid)
+            return &captures[i];
+    return NULL;
+}
+
+/*
+ * captrim - Keep each log to about its last CAPTURESIZE bytes, which
+ *    makes it a ring: once one holds twice that, the older pages are
+ *    punched out of the memfd, while its writers go on appending
+ */
+void captrim(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    struct capture_t *c;
+    struct stat st;
+    off_t keep;
+
+    for (c = captures; c < captures + ncaptures; c++) {
+        if (fstat(c->fd, &st) < 0 || st.st_size - c->start <= 2 * CAPTURESIZE)
+            continue;
+        keep = (st.st_size - CAPTURESIZE) / page * page;
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (fallocate(c->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      c->start, keep - c->start) == 0)
+            c->start = keep;
+#endif
+    }
+}
+
+/*
+ * captick - How long to wait, for at most timeout ms: a log grows
+ *    whatever the shell is waiting on, so while a captured job is in
+ *    the table the logs are trimmed here at least every CAPTICK ms
+ */
+int captick(int timeout) {
+    static uint64_t last;
+    struct capture_t *c;
+    uint64_t now;
+
+    for (c = captures; c < captures + ncaptures; c++)
+        if (getjobpid(jobs, c->pid) != NULL)
+            break;
+    if (c == captures + ncaptures)
+        return timeout;
+    if ((now = nsnow()) - last >= CAPTICK * 1000000ULL) {
+        captrim();
+        last = now;
+    }
+    return timeout < 0 || timeout > CAPTICK ? CAPTICK : timeout;
+}
+
+/* capreport - The jobs -l line on the output a captured job has written */
+void capreport(const struct job_t *job) {
+    struct capture_t *c = capfind(job->jid);
+    struct stat st;
+
+    if (c != NULL && c->pid == job->pid && fstat(c->fd, &st) == 0)
+        outprintf("    output captured, %lld bytes, see logs %%%d\n", (long long)st.st_size, job->jid);
+}
+
+/*
+ * do_logs - Execute the builtin logs command: with %jid, the last
+ *    CAPTURESIZE bytes the job wrote, from a line start; without, the
+ *    captured jobs and how much each has written
+ */
+void do_logs(char **argv) {
+    static char buf[65536];
+    struct capture_t *c;
+    struct job_t *job;
+    struct stat st;
+    off_t off;
+    ssize_t n;
+    char *p, *nl;
+    int cut;
+
+    captrim();
+    if (argv[1] == NULL) {
+        for (c = captures; c < captures + ncaptures; c++) {
+            job = getjobpid(jobs, c->pid);
+            if (fstat(c->fd, &st) < 0)
+                st.st_size = 0;
+            outprintf("[%d] (%d) %s %lld bytes %s\n", c->jid, c->pid,
+                      job == NULL ? "Done" : job->state == ST ? "Stopped" : "Running",
+                      (long long)st.st_size, c->cmdline);
+        }
+        return;
+    }
+    if (argv[1][0] != '%' || argv[2] != NULL) {
+        outprintf("usage: logs [%%jid]\n");
+        return;
+    }
+    if ((c = capfind(atoi(&argv[1][1]))) == NULL) {
+        outprintf("%s: No captured output\n", argv[1]);
+        return;
+    }
+    if (fstat(c->fd, &st) < 0) {
+        outprintf("logs: %s\n", strerror(errno));
+        return;
+    }
+
+    // A log that was cut starts at its first whole line
+    off = st.st_size - CAPTURESIZE > c->start ? st.st_size - CAPTURESIZE : c->start;
+    cut = off > 0;
+    while (off < st.st_size && (n = pread(c->fd, buf, sizeof(buf), off)) > 0) {
+        off += n;
+        p = buf;
+        if (cut) {
+            if ((nl = memchr(buf, '\n', n)) == NULL)
+                continue;
+            p = nl + 1;
+            cut = 0;
+        }
+        outwrite(p, buf + n - p);
+    }
+}
+
+/******************************************************
+ * Helper routines for remote jobs
+ ******************************************************/
+
+/*
+ * sendframe - Send a message of type with len bytes of data on fd.
+ *    Returns -1 if the connection has failed.
+ */
+int sendframe(int fd, uint32_t id, int type, const void *data, size_t len) {
+    struct frame_t fr = { htonl(id), htonl(len), type, { 0 } };
+    struct iovec iov[2] = { { &fr, sizeof(fr) }, { (void *)data, len } };
+    struct msghdr msg;
+    size_t k;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+    while (msg.msg_iovlen > 0) {
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // A short send leaves the rest of the header and payload to go
+        for (; n > 0; n -= k) {
+            k = (size_t)n < msg.msg_iov->iov_len ? (size_t)n : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + k;
+            msg.msg_iov->iov_len -= k;
+            if (msg.msg_iov->iov_len == 0) {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * hostport - Split addr, [host:]port or [v6 address]:port, into buf as
+ *    a host (NULL if there is none) and a port. Returns -1 if it is too
+ *    long for buf.
+ */
+int hostport(const char *addr, char *buf, size_t size, char **host, char **port) {
+    char *p;
+    size_t n;
+
+    if (snprintf(buf, size, "%s", addr) >= (int)size)
+        return -1;
+    if ((p = strrchr(buf, ':')) == NULL) {
+        *host = NULL;
+        *port = buf;
+        return 0;
+    }
+    *p = '\0';
+    *port = p + 1;
+    *host = buf;
+    n = strlen(buf);
+    if (n >= 2 && buf[0] == '[' && buf[n - 1] == ']') {
+        buf[n - 1] = '\0';
+        (*host)++;
+    }
+    return 0;
+}
+
+/*
+ * isunixaddr - Whether addr names a Unix socket rather than a TCP
+ *    host:port: it has a / in it, or no : at all
+ */
+int isunixaddr(const char *addr) {
+    return strchr(addr, '/') != NULL || strchr(addr, ':') == NULL;
+}
+
+/* unixaddr - Fill in sun for the socket at path. Returns -1 if it is too long. */
+int unixaddr(const char *path, struct sockaddr_un *sun) {
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path))
+        return -1;
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+/*
+ * unixstale - Whether the socket at sun was left by an agent that is
+ *    gone: it is a socket, and nothing listens on it
+ */
+int unixstale(const struct sockaddr_un *sun) {
+    struct stat st;
+    int fd, stale;
+
+    if (lstat(sun->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+        return 0;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return 0;
+    stale = connect(fd, (const struct sockaddr *)sun, sizeof(*sun)) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/* peerok - Whether the other end of Unix socket fd runs as our user */
+int peerok(int fd) {
+    struct ucred uc;
+    socklen_t len = sizeof(uc);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) == 0 && uc.uid == geteuid();
+}
+
+/*
+ * readkey - Read the key that shells and TCP agents share from the -k
+ *    file, or by default $HOME/.tsh_agent_key, into key, without the
+ *    newline it may end in. The file must be a regular file of ours
+ *    that nobody else can read or write. Returns the length of the
+ *    key, or -1 after reporting why there is none.
+ */
+int readkey(char *key) {
+    char buf[4096];
+    const char *path = key_path, *home, *why = NULL;
+    struct stat st;
+    ssize_t n = -1;
+    int fd;
+
+    if (path == NULL) {
+        if ((home = getenv("HOME")) == NULL) {
+            outprintf("no key file: use -k file or set HOME\n");
+            return -1;
+        }
+        snprintf(buf, sizeof(buf), "%s/.tsh_agent_key", home);
+        path = buf;
+    }
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0 || fstat(fd, &st) < 0)
+        why = strerror(errno);
+    else if (!S_ISREG(st.st_mode))
+        why = "not a regular file";
+    else if (st.st_uid != geteuid())
+        why = "not owned by you";
+    else if (st.st_mode & 077)
+        why = "open to others (chmod 600 it)";
+    else if ((n = read(fd, key, KEYMAX)) < 0)
+        why = strerror(errno);
+    if (fd >= 0)
+        close(fd);
+    while (why == NULL && n > 0 && (key[n - 1] == '\n' || key[n - 1] == '\r'))
+        n--;
+    if (why == NULL && n < KEYMIN)
+        why = "too short for a key";
+    if (why != NULL) {
+        outprintf("%s: %s\n", path, why);
+        return -1;
+    }
+    return n;
+}
+
+/* keymatch - Whether s is the key, in time that does not depend on where they differ */
+int keymatch(const char *key, size_t keylen, const char *s, size_t len) {
+    unsigned char d = len != keylen;
+    size_t i;
+
+    for (i = 0; i < keylen; i++)
+        d |= key[i] ^ (i < len ? s[i] : 0);
+    return d == 0;
+}
+
+/* local_signal - Executor signal for jobs of the shell's own: their process group */
+int local_signal(struct job_t *job, int sig) {
+    return kill(-job->pid, sig);
+}
+
+/* signaljob - Send sig to every process of job, wherever it runs */
+int signaljob(struct job_t *job, int sig) {
+    return job->ex->signal(job, sig);
+}
+
+/* pipeexec - The executor that runs pl */
+const struct executor_t *pipeexec(const struct pipeline_t *pl) {
+    return &executors[pl->node != NULL];
+}
+
+/* node_add - Add a node called name, not connected yet, for the agent at addr */
+struct node_t *node_add(const char *name, const char *addr) {
+    struct node_t *nd;
+
+    nodes = growarray(nodes, &nodecap, nnodes + 1, sizeof(*nodes));
+    nd = &nodes[nnodes++];
+    if ((nd->name = strdup(name)) == NULL || (nd->addr = strdup(addr)) == NULL)
+        unix_error("node_add: strdup error");
+    nd->fd = -1;
+    nd->in = NULL;
+    nd->inlen = 0;
+    return nd;
+}
+
+/*
+ * node_get - The node called name, or NULL. A name that is itself a
+ *    host:port or a path with a / needs no remote command first, and is
+ *    added on first use.
+ */
+struct node_t *node_get(const char *name) {
+    int i;
+
+    for (i = 0; i < nnodes; i++)
+        if (strcmp(nodes[i].name, name) == 0)
+            return &nodes[i];
+    return strchr(name, ':') != NULL || strchr(name, '/') != NULL ? node_add(name, name) : NULL;
+}
+
+/*
+ * node_connect - Connect to the agent of nd, unless that is done
+ *    already. Every job sent there shares the connection, so only the
+ *    first pays for the round trips. An agent on a Unix socket must
+ *    run as our user; one on TCP must first take the shared key.
+ *    Returns -1 after reporting why it can't be reached.
+ */
+int node_connect(struct node_t *nd) {
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sun;
+    char buf[256], *host, *port;
+    int fd = -1, err, one = 1;
+
+    if (nd->fd >= 0)
+        return 0;
+    if (isunixaddr(nd->addr)) {
+        if (unixaddr(nd->addr, &sun) < 0) {
+            outprintf("@%s: %s: socket path too long\n", nd->name, nd->addr);
+            return -1;
+        }
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 &&
+            connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+            errno = err;
+        }
+        if (fd < 0) {
+            outprintf("@%s: %s: %s\n", nd->name, nd->addr, strerror(errno));
+            return -1;
+        }
+        if (!peerok(fd)) {
+            outprintf("@%s: %s: the agent there is not run by you\n", nd->name, nd->addr);
+            close(fd);
+            return -1;
+        }
+        goto connected;
+    }
+    if (hostport(nd->addr, buf, sizeof(buf), &host, &port) < 0 || host == NULL) {
+        outprintf("@%s: %s: not a host:port\n", nd->name, nd->addr);
+        return -1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(*host ? host : NULL, port, &hints, &res)) != 0) {
+        outprintf("@%s: %s: %s\n", nd->name, nd->addr, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+            errno = err;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        outprintf("@%s: %s: %s\n", nd->name, nd->addr, strerror(errno));
+        return -1;
+    }
+    // Commands and signals are small and should go out at once
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (node_auth(nd, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+connected:
+    if (nd->in == NULL && (nd->in = malloc(sizeof(struct frame_t) + REMOTEMSG)) == NULL)
+        unix_error("node_connect: malloc error");
+    nd->inlen = 0;
+    nd->fd = fd;
+    return 0;
+}
+
+/*
+ * node_auth - Give the key to the agent of nd on the new TCP connection
+ *    fd, and wait for it to be taken. An agent that doesn't take it
+ *    hangs up instead. Returns -1 after reporting why it failed.
+ */
+int node_auth(struct node_t *nd, int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct frame_t fr;
+    char key[KEYMAX];
+    size_t got = 0;
+    ssize_t n;
+    int len;
+
+    if ((len = readkey(key)) < 0)
+        return -1;
+    n = sendframe(fd, 0, FR_AUTH, key, len);
+    memset(key, 0, sizeof(key));
+    if (n < 0) {
+        outprintf("@%s: %s: %s\n", nd->name, nd->addr, strerror(errno));
+        return -1;
+    }
+    while (got < sizeof(fr)) {
+        if ((n = poll(&pfd, 1, AUTHWAIT)) > 0)
+            n = read(fd, (char *)&fr + got, sizeof(fr) - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    if (got < sizeof(fr) || fr.type != FR_AUTH || fr.len != 0) {
+        outprintf("@%s: %s: the agent did not take the key\n", nd->name, nd->addr);
+        return -1;
+    }
+    return 0;
+}
+
+/* node_input - Read what the agent of nd has sent, and act on each whole message */
+void node_input(struct node_t *nd) {
+    struct frame_t fr;
+    size_t off = 0;
+    ssize_t n;
+
+    n = read(nd->fd, nd->in + nd->inlen, sizeof(fr) + REMOTEMSG - nd->inlen);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n <= 0) {
+        node_lost(nd);
+        return;
+    }
+    nd->inlen += n;
+    while (nd->inlen - off >= sizeof(fr)) {
+        memcpy(&fr, nd->in + off, sizeof(fr));
+        fr.id = ntohl(fr.id);
+        fr.len = ntohl(fr.len);
+        if (fr.len > REMOTEMSG) {
+            node_lost(nd); // Not an agent, or not one we can talk to
+            return;
+        }
+        if (nd->inlen - off < sizeof(fr) + fr.len)
+            break;
+        node_frame(nd, &fr, nd->in + off + sizeof(fr));
+        off += sizeof(fr) + fr.len;
+    }
+    memmove(nd->in, nd->in + off, nd->inlen - off);
+    nd->inlen -= off;
+}
+
+/*
+ * node_frame - Act on one message from an agent: output of a job goes
+ *    out with the shell's own, or to its capture, and a state change
+ *    is applied to the job table like any child's
+ */
+void node_frame(struct node_t *nd, const struct frame_t *fr, const char *data) {
+    struct rproc_t *rp = rproc_find(fr->id);
+    uint32_t st[2];
+    int code;
+
+    if (rp == NULL)
+        return; // A job that was given up on
+    switch (fr->type) {
+        case FR_OUT:
+        case FR_ERR:
+            if (rp->out < 0)
+                outwrite(data, fr->len);
+            else if (write(rp->out, data, fr->len) < 0)
+                outprintf("@%s: %s\n", nd->name, strerror(errno));
+            break;
+        case FR_STATUS:
+            if (fr->len != sizeof(st))
+                break;
+            memcpy(st, data, sizeof(st));
+            code = ntohl(st[0]);
+            if (code == CLD_EXITED || code == CLD_KILLED || code == CLD_DUMPED)
+                rproc_done(rp);
+            childstatus(fr->id, code, ntohl(st[1]), NULL);
+            break;
+    }
+}
+
+/*
+ * node_lost - The connection to the agent of nd has failed. Its jobs
+ *    are reported as hung up on, which is what the agent does to them.
+ */
+void node_lost(struct node_t *nd) {
+    int i = nd - nodes, k;
+    pid_t pid;
+
+    close(nd->fd);
+    nd->fd = -1;
+    nd->inlen = 0;
+    outprintf("@%s: lost the connection to its agent\n", nd->name);
+    for (k = nrprocs - 1; k >= 0; k--) {
+        if (rprocs[k].node == i) {
+            pid = rprocs[k].pid;
+            rproc_done(&rprocs[k]);
+            childstatus(pid, CLD_KILLED, SIGHUP, NULL);
+        }
+    }
+}
+
+/* rproc_find - The remote job with pid, or NULL */
+struct rproc_t *rproc_find(pid_t pid) {
+    int i;
+
+    for (i = 0; i < nrprocs; i++)
+        if (rprocs[i].pid == pid)
+            return &rprocs[i];
+    return NULL;
+}
+
+/* rproc_done - Forget rp, a remote job that has ended */
+void rproc_done(struct rproc_t *rp) {
+    if (rp->out >= 0)
+        close(rp->out);
+    *rp = rprocs[--nrprocs];
+}
+
+/*
+ * remote_start - Executor start for a pipeline with @node: its text
+ *    goes to the node's agent, to be run under sh -c with stdin from
+ *    /dev/null, and the job is added under a pid that only stands for
+ *    it here. Its output and its state changes come back as messages.
+ */
+pid_t remote_start(struct pipeline_t *pl, int bg, char *cmdline) {
+    struct node_t *nd;
+    struct rproc_t *rp;
+    struct job_t *job;
+    pid_t pid;
+    int capfd;
+
+    // Job boundary, as for a local job
+    wait_events(-1, 0);
+    last_status = 127;
+    if (use_uring) {
+        outprintf("@%s: remote jobs need the poll() event loop, not -U\n", pl->node);
+        return 0;
+    }
+    if ((nd = node_get(pl->node)) == NULL) {
+        outprintf("@%s: No such node\n", pl->node);
+        return 0;
+    }
+    if (node_connect(nd) < 0)
+        return 0;
+    pid = remote_next++;
+    if (sendframe(nd->fd, pid, FR_RUN, cmdline + pl->body, pl->bodyend - pl->body) < 0) {
+        node_lost(nd);
+        return 0;
+    }
+    last_status = 0;
+
+    capfd = pl->captured ? capopen() : -1;
+    rprocs = growarray(rprocs, &rproccap, nrprocs + 1, sizeof(*rprocs));
+    rp = &rprocs[nrprocs++];
+    rp->pid = pid;
+    rp->node = nd - nodes;
+    rp->out = capfd >= 0 ? fcntl(capfd, F_DUPFD_CLOEXEC, 0) : -1;
+
+    addjob(jobs, pid, bg ? BG : FG, cmdline);
+    job = getjobpid(jobs, pid);
+    job->ex = &executors[1];
+    clock_gettime(CLOCK_MONOTONIC, &job->tstart);
+    job->texec = job->tstart;
+    if (pl->timed)
+        job->flags |= JOB_TIMED;
+    if (capfd >= 0) {
+        job->flags |= JOB_CAPTURED;
+        capadd(job, capfd);
+    }
+    return pid;
+}
+
+/*
+ * remote_signal - Executor signal for remote jobs: the agent sends it
+ *    to the job's process group. Any change of state comes back later.
+ */
+int remote_signal(struct job_t *job, int sig) {
+    struct rproc_t *rp = rproc_find(job->pid);
+    uint32_t s = htonl(sig);
+
+    if (rp == NULL || nodes[rp->node].fd < 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    // A failed connection is noticed, and its jobs ended, by the event loop
+    return sendframe(nodes[rp->node].fd, rp->pid, FR_SIGNAL, &s, sizeof(s));
+}
+
+/*
+ * do_remote - Execute the builtin remote command: remote lists the
+ *    nodes, remote name addr sends the jobs of @name to the agent
+ *    listening on addr, a socket path or a host:port
+ */
+void do_remote(char **argv) {
+    struct node_t *nd;
+    int i, k, n;
+
+    if (argv[1] == NULL) {
+        for (i = 0; i < nnodes; i++) {
+            for (k = n = 0; k < nrprocs; k++)
+                n += rprocs[k].node == i;
+            outprintf("%-12s %s %s, %d jobs\n", nodes[i].name, nodes[i].addr,
+                      nodes[i].fd >= 0 ? "connected" : "not connected", n);
+        }
+        return;
+    }
+    if (argv[2] == NULL || argv[3] != NULL) {
+        outprintf("usage: remote [name path|host:port]\n");
+        return;
+    }
+    for (i = 0; i < nnodes && strcmp(nodes[i].name, argv[1]) != 0; i++)
+        ;
+    if (i == nnodes) {
+        node_add(argv[1], argv[2]);
+        return;
+    }
+    nd = &nodes[i];
+    for (k = 0; k < nrprocs; k++) {
+        if (rprocs[k].node == i) {
+            outprintf("remote: %s has jobs running\n", nd->name);
+            return;
+        }
+    }
+    if (nd->fd >= 0)
+        close(nd->fd);
+    nd->fd = -1;
+    free(nd->addr);
+    if ((nd->addr = strdup(argv[2])) == NULL)
+        unix_error("do_remote: strdup error");
+}
+
+/*
+ * agent - Be the agent for remote jobs (-A), and never return. Shells
+ *    connect on addr, and each may send any number of jobs over its
+ *    connection. A job is run by sh -c in a process group of its own,
+ *    and what it writes and each change of its state are sent back the
+ *    same way. Whoever connects runs commands as us, so by default addr
+ *    is a Unix socket, made 0600 and only taken from our own user; ssh
+ *    -L can forward it to another host. A host:port listens on TCP
+ *    instead, and then a shell must first send the key of the -k file,
+ *    or it is cut off. The key and the jobs are not encrypted there.
+ */
+void agent(const char *addr) {
+    struct achild_t {       /* a job run for a shell */
+        pid_t pid;          /* leads its own process group */
+        int conn;           /* index in conns[], -1 once that one is gone */
+        uint32_t id;        /* its pid in that shell */
+        int out, err;       /* its stdout and stderr, -1 at EOF */
+        int done;           /* reaped; the status is sent at EOF on both */
+        uint32_t st[2];     /* how it ended, in network order */
+    } *kids = NULL;
+    struct aconn_t {        /* a shell connected to us */
+        int fd;
+        int authed;         /* gave the key, or needs none */
+        char *in;           /* as node_t.in */
+        size_t inlen;
+    } *conns = NULL;
+    int nkids = 0, kidcap = 0, nconns = 0, conncap = 0, fdcap = 0;
+    struct pollfd *fds = NULL;
+    struct addrinfo hints, *res;
+    struct sockaddr_un sun;
+    struct frame_t fr;
+    struct achild_t *kid;
+    struct aconn_t *cn;
+    char buf[REMOTEMSG + 1], abuf[256], *host, *port;  /* a command and its NUL */
+    char key[KEYMAX];
+    int lfd, pfd[2], op[2], ep[2], nfds, one = 1, err, status, i, k, fd;
+    int local = isunixaddr(addr), keylen = 0;
+    uint32_t sig;
+    mode_t mask;
+    size_t off;
+    ssize_t n;
+    pid_t pid;
+
+    if (local) {
+        if (unixaddr(addr, &sun) < 0)
+            app_error("agent: socket path too long");
+        if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            unix_error("agent: socket error");
+        // Nobody else may connect, from the moment the socket exists
+        mask = umask(077);
+        err = bind(lfd, (struct sockaddr *)&sun, sizeof(sun));
+        if (err < 0 && errno == EADDRINUSE && unixstale(&sun) && unlink(addr) == 0)
+            err = bind(lfd, (struct sockaddr *)&sun, sizeof(sun));
+        umask(mask);
+        if (err < 0 || chmod(addr, 0600) < 0 || listen(lfd, 16) < 0)
+            unix_error("agent: bind error");
+    } else {
+        if ((keylen = readkey(key)) < 0)
+            exit(1);
+        if (hostport(addr, abuf, sizeof(abuf), &host, &port) < 0)
+            app_error("agent: address too long");
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if ((err = getaddrinfo(*host ? host : NULL, port, &hints, &res)) != 0) {
+            outprintf("agent: %s: %s\n", addr, gai_strerror(err));
+            exit(1);
+        }
+        if ((lfd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) < 0)
+            unix_error("agent: socket error");
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(lfd, res->ai_addr, res->ai_addrlen) < 0 || listen(lfd, 16) < 0)
+            unix_error("agent: bind error");
+        freeaddrinfo(res);
+    }
+
+    // Exits wake the loop through a self-pipe, whichever build this is
+    if (pipe(pfd) < 0)
+        unix_error("pipe error");
+    for (i = 0; i < 2; i++) {
+        fcntl(pfd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(pfd[i], F_SETFL, O_NONBLOCK);
+    }
+    sigpipe_w = pfd[1];
+    Signal(SIGPIPE, SIG_IGN);
+    Signal(SIGCHLD, agent_sigchld);
+    if (verbose)
+        outprintf("agent: listening on %s\n", addr);
+
+    for (;;) {
+        if (fdcap < 2 + nconns + 2 * nkids) {
+            fdcap = 2 + nconns + 2 * nkids;
+            if ((fds = realloc(fds, fdcap * sizeof(*fds))) == NULL)
+                unix_error("agent: realloc error");
+        }
+        fds[0] = (struct pollfd){ lfd, POLLIN, 0 };
+        fds[1] = (struct pollfd){ pfd[0], POLLIN, 0 };
+        nfds = 2;
+        for (i = 0; i < nconns; i++)
+            fds[nfds++] = (struct pollfd){ conns[i].fd, POLLIN, 0 };
+        for (i = 0; i < nkids; i++) {
+            fds[nfds++] = (struct pollfd){ kids[i].out, POLLIN, 0 };
+            fds[nfds++] = (struct pollfd){ kids[i].err, POLLIN, 0 };
+        }
+        outflush();
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR)
+                unix_error("agent: poll error");
+            continue;
+        }
+
+        // Output first, so a job's last bytes go out ahead of its exit
+        for (i = 0; i < nkids; i++) {
+            kid = &kids[i];
+            for (k = 0; k < 2; k++) {
+                fd = k == 0 ? kid->out : kid->err;
+                if (!(fds[2 + nconns + 2 * i + k].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+                if ((n = read(fd, buf, REMOTEMSG)) < 0 && errno == EINTR)
+                    continue;
+                if (n > 0 && kid->conn >= 0) {
+                    sendframe(conns[kid->conn].fd, kid->id, k == 0 ? FR_OUT : FR_ERR, buf, n);
+                } else if (n <= 0) {
+                    close(fd);
+                    *(k == 0 ? &kid->out : &kid->err) = -1;
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (read(pfd[0], buf, sizeof(buf)) > 0)
+                ;
+            while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+                for (kid = kids; kid < kids + nkids && kid->pid != pid; kid++)
+                    ;
+                if (kid == kids + nkids)
+                    continue;
+                if (WIFEXITED(status)) {
+                    kid->st[0] = CLD_EXITED;
+                    kid->st[1] = WEXITSTATUS(status);
+                } else if (WIFSIGNALED(status)) {
+                    kid->st[0] = WCOREDUMP(status) ? CLD_DUMPED : CLD_KILLED;
+                    kid->st[1] = WTERMSIG(status);
+                } else if (WIFSTOPPED(status)) {
+                    kid->st[0] = CLD_STOPPED;
+                    kid->st[1] = WSTOPSIG(status);
+                } else {
+                    kid->st[0] = CLD_CONTINUED;
+                    kid->st[1] = SIGCONT;
+                }
+                kid->st[0] = htonl(kid->st[0]);
+                kid->st[1] = htonl(kid->st[1]);
+                if (WIFEXITED(status) || WIFSIGNALED(status))
+                    kid->done = 1;
+                else if (kid->conn >= 0)
+                    sendframe(conns[kid->conn].fd, kid->id, FR_STATUS, kid->st, sizeof(kid->st));
+            }
+        }
+
+        // A job is over once it is reaped and its output has all gone
+        for (i = nkids - 1; i >= 0; i--) {
+            kid = &kids[i];
+            if (!kid->done || kid->out >= 0 || kid->err >= 0)
+                continue;
+            if (kid->conn >= 0)
+                sendframe(conns[kid->conn].fd, kid->id, FR_STATUS, kid->st, sizeof(kid->st));
+            kids[i] = kids[--nkids];
+        }
+
+        for (i = nconns - 1; i >= 0; i--) {
+            cn = &conns[i];
+            if (!(fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if ((n = read(cn->fd, cn->in + cn->inlen, sizeof(fr) + REMOTEMSG - cn->inlen)) < 0 && errno == EINTR)
+                continue;
+            off = 0;
+            if (n > 0) {
+                cn->inlen += n;
+                while (cn->inlen - off >= sizeof(fr)) {
+                    memcpy(&fr, cn->in + off, sizeof(fr));
+                    fr.id = ntohl(fr.id);
+                    fr.len = ntohl(fr.len);
+                    if (fr.len > REMOTEMSG || (!cn->authed && (fr.type != FR_AUTH || fr.len > KEYMAX))) {
+                        n = 0;
+                        break;
+                    }
+                    if (cn->inlen - off < sizeof(fr) + fr.len)
+                        break;
+                    off += sizeof(fr);
+                    if (!cn->authed) {
+                        // Nothing is run for a shell before it has given the key
+                        if (!keymatch(key, keylen, cn->in + off, fr.len)) {
+                            n = 0;
+                            break;
+                        }
+                        cn->authed = 1;
+                        sendframe(cn->fd, 0, FR_AUTH, NULL, 0);
+                    } else if (fr.type == FR_RUN) {
+                        memcpy(buf, cn->in + off, fr.len);
+                        buf[fr.len] = '\0';
+                        if (pipe2(op, O_CLOEXEC) < 0 || pipe2(ep, O_CLOEXEC) < 0)
+                            unix_error("agent: pipe error");
+                        if ((pid = fork()) < 0)
+                            unix_error("agent: fork error");
+                        if (pid == 0) {
+                            // Signals the agent ignores, maybe from being started
+                            // with &, must reach the job as they would here
+                            setpgid(0, 0);
+                            for (k = 1; k < NSIG; k++)
+                                signal(k, SIG_DFL);
+                            if ((fd = open("/dev/null", O_RDONLY)) >= 0)
+                                dup2(fd, STDIN_FILENO);
+                            dup2(op[1], STDOUT_FILENO);
+                            dup2(ep[1], STDERR_FILENO);
+                            execl("/bin/sh", "sh", "-c", buf, (char *)NULL);
+                            _exit(127);
+                        }
+                        setpgid(pid, pid);
+                        close(op[1]);
+                        close(ep[1]);
+                        kids = growarray(kids, &kidcap, nkids + 1, sizeof(*kids));
+                        kids[nkids++] = (struct achild_t){ pid, i, fr.id, op[0], ep[0], 0, { 0, 0 } };
+                    } else if (fr.type == FR_SIGNAL && fr.len == sizeof(sig)) {
+                        memcpy(&sig, cn->in + off, sizeof(sig));
+                        for (kid = kids; kid < kids + nkids; kid++)
+                            if (kid->conn == i && kid->id == fr.id && !kid->done)
+                                kill(-kid->pid, ntohl(sig));
+                    }
+                    off += fr.len;
+                }
+                memmove(cn->in, cn->in + off, cn->inlen - off);
+                cn->inlen -= off;
+            }
+            if (n > 0)
+                continue;
+
+            // The shell is gone: hang up on its jobs, as a terminal would
+            for (kid = kids; kid < kids + nkids; kid++) {
+                if (kid->conn == i) {
+                    kid->conn = -1;
+                    if (!kid->done) {
+                        kill(-kid->pid, SIGHUP);
+                        kill(-kid->pid, SIGCONT);
+                    }
+                } else if (kid->conn == nconns - 1) {
+                    kid->conn = i;
+                }
+            }
+            close(cn->fd);
+            free(cn->in);
+            conns[i] = conns[--nconns];
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+                continue;
+            if (local && !peerok(fd)) {
+                close(fd);
+                continue;
+            }
+            if (!local)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            conns = growarray(conns, &conncap, nconns + 1, sizeof(*conns));
+            conns[nconns].fd = fd;
+            conns[nconns].authed = local;
+            conns[nconns].inlen = 0;
+            if ((conns[nconns++].in = malloc(sizeof(fr) + REMOTEMSG)) == NULL)
+                unix_error("agent: malloc error");
+        }
+    }
+}
+
+/* agent_sigchld - Wake the agent's loop to reap */
+void agent_sigchld(int sig) {
+    int olderrno = errno;
+
+    if (write(sigpipe_w, "", 1) < 0) {
+        // The pipe is full; the loop still has a wakeup pending
+    }
+    errno = olderrno;
+}
+
+/******************************************************
+ * Helper routines for job cgroups
+ ******************************************************/
+
+/*
+ * With -C dir every job gets a cgroup v2 leaf of its own under dir,
+ * so the kernel accounts for and limits the whole process tree of the
+ * job, including whatever its processes fork. A process is created
+ * straight inside the leaf with clone3(CLONE_INTO_CGROUP) and, where
+ * the kernel lacks that, moves itself in before it execs.
+ */
+
+/*
+ * cginit - Open (creating it if need be) the cgroup that job leaves go
+ *    under, and turn on the controllers its children may use
+ */
+void cginit(const char *path) {
+    static const char *ctl[] = { "+cpu", "+memory", "+io", "+pids" };
+    int i;
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        outprintf("%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if ((cg_root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        outprintf("%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    // One at a time, so a controller the parent lacks doesn't stop the rest
+    for (i = 0; i < (int)(sizeof(ctl) / sizeof(ctl[0])); i++)
+        cgwrite(cg_root, "cgroup.subtree_control", ctl[i]);
+}
+
+/* cgname - Name of leaf seq under the -C cgroup */
+void cgname(char *buf, int seq) {
+    snprintf(buf, CGNAME, "tsh-%d-%d", (int)getpid(), seq);
+}
 
-        
-        eval(cmdline);
-        fflush(stdout);
-    } 
+/*
+ * cgnew - Make the leaf for a new job, with the default limits, and
+ *    return its directory with its number in *seq; -1 (the job then
+ *    runs in no leaf) if it can't be made
+ */
+int cgnew(int *seq) {
+    char name[CGNAME];
+    int fd;
 
-    exit(0); 
+    cgname(name, ++cg_seq);
+    if (mkdirat(cg_root, name, 0755) < 0 ||
+        (fd = openat(cg_root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        outprintf("%s/%s: %s\n", cg_path, name, strerror(errno));
+        return -1;
+    }
+    if (cg_cpu[0] != '\0' && cgwrite(fd, "cpu.max", cg_cpu) < 0)
+        outprintf("%s/%s/cpu.max: %s\n", cg_path, name, strerror(errno));
+    if (cg_mem[0] != '\0' && cgwrite(fd, "memory.max", cg_mem) < 0)
+        outprintf("%s/%s/memory.max: %s\n", cg_path, name, strerror(errno));
+    *seq = cg_seq;
+    return fd;
 }
-/* 
- * eval - Evaluate the command line that the user has just typed in
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return. 
-*/
-void eval(char *cmdline) {
-    char *argv[MAXARGS]; // Argument list for execve()
-    char buf[MAXLINE];   // Holds modified command line
-    int bg;              // Should the job run in bg or fg?
-    pid_t pid;           // Process id
-    sigset_t mask;       // Signal set for blocking
 
-    strcpy(buf, cmdline);
-    bg = parseline(buf, argv);
-    if (argv[0] == NULL) return; // Ignore empty lines
+/*
+ * cgdone - Remove the leaf of a job that is done. A leaf that still
+ *    has processes (the job left some running) stays behind.
+ */
+void cgdone(int seq, int fd) {
+    char name[CGNAME];
 
-    if (!builtin_cmd(argv)) {
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGCHLD);
-        sigaddset(&mask, SIGINT);
-        sigaddset(&mask, SIGTSTP);
-        sigprocmask(SIG_BLOCK, &mask, NULL); // Block SIGCHLD, SIGINT, SIGTSTP
+    close(fd);
+    cgname(name, seq);
+    unlinkat(cg_root, name, AT_REMOVEDIR);
+}
 
-        if ((pid = fork()) == 0) { // Child process
-            sigprocmask(SIG_UNBLOCK, &mask, NULL); // Unblock signals
-            setpgid(0, 0); // Put the child in a new process group
+/* cgwrite - Write val to file in the cgroup directory dirfd */
+int cgwrite(int dirfd, const char *file, const char *val) {
+    ssize_t n = -1;
+    int fd;
 
-            if (execvp(argv[0], argv) < 0) {
-                fprintf(stderr, "%s: Command not found\n", argv[0]);
-                exit(1);
-            }
-        }
+    if ((fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = write(fd, val, strlen(val));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
 
-        // Parent process
-        addjob(jobs, pid, bg ? BG : FG, cmdline); // Add the job to the job list
+/* cgread - Read file of the cgroup directory dirfd into buf; -1 if it can't */
+static int cgread(int dirfd, const char *file, char *buf, size_t size) {
+    ssize_t n;
+    int fd;
 
-        if (!bg) {
-            waitfg(pid); // Wait for foreground job to finish
-        } else {
-            printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); // Print background job
-        }
+    if ((fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
 
-        sigprocmask(SIG_UNBLOCK, &mask, NULL); // Unblock signals
-    }
+/* cgfield - Value of key in a "key value" cgroup file, -1 if missing */
+static long long cgfield(const char *buf, const char *key) {
+    size_t len = strlen(key);
+    const char *p;
+
+    for (p = buf; (p = strstr(p, key)) != NULL; p += len)
+        if ((p == buf || p[-1] == '\n' || p[-1] == ' ') && p[len] == ' ')
+            return atoll(p + len + 1);
+    return -1;
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return number of arguments parsed.
+/*
+ * cgfork - fork() into the cgroup cgfd (no cgroup if -1). The child
+ *    is created in the cgroup by clone3() where the kernel can; else
+ *    it moves itself there before returning.
  */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to space or quote delimiters */
-    int argc;                   /* number of args */
+pid_t cgfork(int cgfd) {
+#if defined(__linux__) && defined(SYS_clone3)
+    static int noclone3 = 0;
+    struct {
+        uint64_t flags, pidfd, child_tid, parent_tid, exit_signal;
+        uint64_t stack, stack_size, tls, set_tid, set_tid_size, cgroup;
+    } args;
+    long pid;
+#endif
+    pid_t child;
+    int fd;
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
-
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
+    if (cgfd < 0)
+        return fork();
+#if defined(__linux__) && defined(SYS_clone3)
+    if (!noclone3) {
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgfd;
+        if ((pid = syscall(SYS_clone3, &args, sizeof(args))) >= 0)
+            return pid;
+        if (errno != ENOSYS && errno != EINVAL && errno != E2BIG)
+            return -1;
+        noclone3 = 1; // Older kernel: move in by hand from now on
     }
-    else {
-        delim = strchr(buf, ' ');
+#endif
+    if ((child = fork()) == 0 &&
+        (fd = openat(cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC)) >= 0) {
+        write(fd, "0", 1);
+        close(fd);
     }
+    return child;
+}
 
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-            buf++;
+/* cgsize - bytes as a short human-readable size */
+static char *cgsize(char *buf, long long bytes) {
+    if (bytes >= 1 << 30)
+        sprintf(buf, "%.1fG", bytes / (double)(1 << 30));
+    else if (bytes >= 1 << 20)
+        sprintf(buf, "%.1fM", bytes / (double)(1 << 20));
+    else
+        sprintf(buf, "%lldK", bytes >> 10);
+    return buf;
+}
 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
-        }
-        else {
-            delim = strchr(buf, ' ');
-        }
+/*
+ * cgreport - The jobs -l line for a job's cgroup: CPU, memory and IO
+ *    of its whole process tree, as far as the controllers tell
+ */
+void cgreport(int cgfd) {
+    char buf[4096], a[32], b[32];
+    long long v, rd = 0, wr = 0;
+    char *p;
+
+    outprintf("    cgroup");
+    if (cgread(cgfd, "cpu.stat", buf, sizeof(buf)) == 0 && (v = cgfield(buf, "usage_usec")) >= 0)
+        outprintf(" cpu %.3fs (user %.3fs, sys %.3fs)", v / 1e6,
+                  cgfield(buf, "user_usec") / 1e6, cgfield(buf, "system_usec") / 1e6);
+    if (cgread(cgfd, "memory.current", buf, sizeof(buf)) == 0) {
+        outprintf(", mem %s", cgsize(a, atoll(buf)));
+        if (cgread(cgfd, "memory.peak", buf, sizeof(buf)) == 0)
+            outprintf(" (peak %s)", cgsize(b, atoll(buf)));
     }
-    argv[argc] = NULL;
-    
-    return argc;
+    if (cgread(cgfd, "io.stat", buf, sizeof(buf)) == 0) {
+        // One line per device: "maj:min rbytes=N wbytes=N ..."
+        for (p = buf; (p = strstr(p, "rbytes=")) != NULL; p++)
+            rd += atoll(p + 7);
+        for (p = buf; (p = strstr(p, "wbytes=")) != NULL; p++)
+            wr += atoll(p + 7);
+        outprintf(", io read %s write %s", cgsize(a, rd), cgsize(b, wr));
+    }
+    if (cgread(cgfd, "pids.current", buf, sizeof(buf)) == 0)
+        outprintf(", pids %lld", atoll(buf));
+    if (cgread(cgfd, "cpu.max", buf, sizeof(buf)) == 0 && strncmp(buf, "max", 3) != 0)
+        outprintf(", cpu.max %.*s", (int)strcspn(buf, "\n"), buf);
+    if (cgread(cgfd, "memory.max", buf, sizeof(buf)) == 0 && strncmp(buf, "max", 3) != 0)
+        outprintf(", memory.max %s", cgsize(a, atoll(buf)));
+    outprintf("\n");
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
- */
-int builtin_cmd(char **argv) {
-    if (strcmp(argv[0], "quit") == 0) {
-        // Exit the shell
-        exit(0);
-    } else if (strcmp(argv[0], "jobs") == 0) {
-        // List all background jobs
-        listjobs(jobs);
-        return 1;
-    } else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
-        // Execute the bg or fg command
-        do_bgfg(argv);
+/* sizeunit - Multiplier of a size suffix: none, K, M or G; 0 if bad */
+static double sizeunit(const char *suffix) {
+    if (suffix[0] == '\0')
         return 1;
+    if (suffix[1] != '\0')
+        return 0;
+    switch (suffix[0]) {
+        case 'k': case 'K': return 1 << 10;
+        case 'm': case 'M': return 1 << 20;
+        case 'g': case 'G': return 1 << 30;
     }
-    return 0; // Not a builtin command
+    return 0;
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+/*
+ * do_limit - Execute the builtin limit command:
+ *
+ *    limit [%jid] [cpu PCT%|max] [mem SIZE|max]
+ *
+ *    Sets cpu.max and memory.max of the job's cgroup, or without a
+ *    job the limits every new job starts with. CPU is a percentage
+ *    of one CPU (200% is two), memory a size in bytes with an
+ *    optional K, M or G. With no limits given, shows the defaults.
  */
-void do_bgfg(char **argv) {
+void do_limit(char **argv) {
+    char cpu[32] = "", mem[32] = "", *end;
     struct job_t *job = NULL;
-    pid_t pid;
-    int jid;
+    double v, mult;
+    int i = 1;
 
-    // Argument validation
-    if (argv[1] == NULL) {
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+    if (cg_root < 0) {
+        outprintf("limit: needs job cgroups; start the shell with -C dir\n");
         return;
     }
-
-    // Determine if argument is PID or JID and get the job
-    if (argv[1][0] == '%') {
-        jid = atoi(&argv[1][1]);
-        if (jid <= 0) {
-            printf("%s: argument must be a positive integer\n", argv[0]);
-            return;
-        }
-        job = getjobjid(jobs, jid);
-        if (job == NULL) {
-            printf("%s: No such job\n", argv[1]);
-            return;
-        }
-        pid = job->pid;
-    } else {
-        pid = atoi(argv[1]);
-        if (pid <= 0) {
-            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+    if (argv[i] != NULL && argv[i][0] == '%') {
+        if ((job = getjobjid(jobs, atoi(&argv[i][1]))) == NULL) {
+            outprintf("%s: No such job\n", argv[i]);
             return;
         }
-        job = getjobpid(jobs, pid);
-        if (job == NULL) {
-            printf("(%d): No such process\n", pid);
+        if (job->cgseq == 0) {
+            outprintf("%s: job has no cgroup\n", argv[i]);
             return;
         }
+        i++;
+    }
+    if (argv[i] == NULL && job == NULL) {
+        outprintf("cpu %s, mem %s\n", cg_cpu[0] ? cg_cpu : "max", cg_mem[0] ? cg_mem : "max");
+        return;
     }
 
-    // Send the job a continue signal
-    if (kill(-pid, SIGCONT) < 0) {
-        unix_error("kill error");
+    for (; argv[i] != NULL; i += 2) {
+        if (argv[i + 1] == NULL)
+            goto usage;
+        v = strtod(argv[i + 1], &end);
+        if (strcmp(argv[i], "cpu") == 0) {
+            if (strcmp(argv[i + 1], "max") == 0)
+                strcpy(cpu, "max 100000");
+            else if (v > 0 && strcmp(end, "%") == 0)
+                snprintf(cpu, sizeof(cpu), "%ld 100000", (long)(v * 1000 + 0.5));
+            else
+                goto usage;
+        } else if (strcmp(argv[i], "mem") == 0) {
+            if (strcmp(argv[i + 1], "max") == 0)
+                strcpy(mem, "max");
+            else if (v > 0 && (mult = sizeunit(end)) > 0)
+                snprintf(mem, sizeof(mem), "%.0f", v * mult);
+            else
+                goto usage;
+        } else {
+            goto usage;
+        }
     }
 
-    // Change the job state and possibly wait for it
-    if (strcmp(argv[0], "bg") == 0) {
-        job->state = BG;
-        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
-    } else if (strcmp(argv[0], "fg") == 0) {
-        job->state = FG;
-        waitfg(job->pid);
+    if (job == NULL) {
+        if (cpu[0] != '\0')
+            strcpy(cg_cpu, cpu);
+        if (mem[0] != '\0')
+            strcpy(cg_mem, mem);
+        return;
     }
+    if (cpu[0] != '\0' && cgwrite(job->cgfd, "cpu.max", cpu) < 0)
+        outprintf("limit: cpu.max: %s\n", strerror(errno));
+    if (mem[0] != '\0' && cgwrite(job->cgfd, "memory.max", mem) < 0)
+        outprintf("limit: memory.max: %s\n", strerror(errno));
+    return;
+
+usage:
+    outprintf("usage: limit [%%jid] [cpu PCT%%|max] [mem SIZE|max]\n");
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+
+/******************************************************
+ * Helper routines for job placement
+ ******************************************************/
+
+/*
+ * With -a policy background jobs are spread over the CPUs the shell
+ * may run on, instead of all of them sharing its affinity:
+ *
+ *    rr     one CPU per job, taking the CPUs in turn
+ *    pack   one CPU per job, the least loaded, filling one NUMA node
+ *           before moving on to the next
+ *    node   all CPUs of the least loaded NUMA node, with the job's
+ *           memory taken from that node first
+ *
+ * Children inherit affinity and memory policy, so the shell takes on
+ * a job's placement while it starts the job's processes and drops it
+ * again afterwards; posix_spawn(), fork() and clone3() all work the
+ * same way then. A pool worker exists already and is sent the
+ * placement along with the command.
  */
-void waitfg(pid_t pid) {
-    int status;
 
-    if (pid < 1) {
-        printf("waitfg: Invalid PID\n");
-        return;
-    }
+/* inset - Whether i is in set */
+static inline int inset(const struct cpuset_t *set, int i) {
+    return i >= 0 && i < MAXCPUS && (set->bits[i / 64] >> (i % 64) & 1);
+}
 
-    while (1) {
-        pid_t wpid = waitpid(pid, &status, WUNTRACED);
+/* addset - Put i in set */
+static inline void addset(struct cpuset_t *set, int i) {
+    if (i >= 0 && i < MAXCPUS)
+        set->bits[i / 64] |= 1ULL << (i % 64);
+}
 
-        if (wpid < 0) {
-            unix_error("waitfg: waitpid error");
-            return;
-        }
+/*
+ * parselist - Read a kernel CPU or node list such as "0-3,8,10-11"
+ *    into set. Returns the number of members, -1 if s isn't a list.
+ */
+static int parselist(const char *s, struct cpuset_t *set) {
+    char *end;
+    long lo, hi;
+    int n = 0;
 
-        struct job_t *job = getjobpid(jobs, pid);
-        if (!job) {
-            printf("waitfg: No job found for PID %d\n", pid);
-            return;
-        }
+    memset(set, 0, sizeof(*set));
+    while (*s != '\0' && *s != '\n') {
+        lo = hi = strtol(s, &end, 10);
+        if (end == s)
+            return -1;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi; lo++, n++)
+            addset(set, lo);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
 
-        if (WIFSTOPPED(status)) {
-            job->state = ST;
-            printf("Job [%d] (%d) stopped by signal %d\n", job->jid, pid, WSTOPSIG(status));
-            break;
-        } else if (WIFSIGNALED(status)) {
-            printf("Job [%d] (%d) terminated by signal %d\n", job->jid, pid, WTERMSIG(status));
-            deletejob(jobs, pid);  // Remove the job from the job list
-            break;
-        } else if (WIFEXITED(status)) {
-            deletejob(jobs, pid);  // Remove the job from the job list
-            break;
+/* printlist - set as a kernel-style list into buf of size bytes */
+static char *printlist(char *buf, size_t size, const struct cpuset_t *set) {
+    size_t len = 0;
+    int i, j;
+
+    buf[0] = '\0';
+    for (i = 0; i < MAXCPUS && len < size; i = j) {
+        if (!inset(set, i)) {
+            j = i + 1;
+            continue;
         }
+        for (j = i + 1; inset(set, j); j++)
+            ;
+        if (j - 1 > i)
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", i, j - 1);
+        else
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
     }
+    return buf;
 }
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/* readsys - Read the sysfs file path into buf; -1 if it can't */
+static int readsys(const char *path, char *buf, size_t size) {
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/*
+ * placeinit - Set up the -a policy: learn the CPUs the shell may use
+ *    and which NUMA node each of them is on. Without NUMA in sysfs all
+ *    of them make up node 0.
  */
-void sigchld_handler(int sig) {
-    int olderrno = errno;
-    sigset_t mask_all, prev_all;
-    pid_t pid;
-    int status;
+void placeinit(const char *policy) {
+    static const char *names[] = { "none", "rr", "pack", "node" };
+    struct cpuset_t online, cpus;
+    char path[64], buf[4096];
+    int c, i, k, n, any;
+#ifdef __linux__
+    cpu_set_t own;
+#endif
+
+    for (placer.policy = PL_NONE; placer.policy <= PL_NODE; placer.policy++)
+        if (strcmp(policy, names[placer.policy]) == 0)
+            break;
+    if (placer.policy > PL_NODE) {
+        outprintf("-a: no placement policy '%s' (rr, pack, node or none)\n", policy);
+        exit(1);
+    }
+    if (placer.policy == PL_NONE)
+        return;
 
-    sigfillset(&mask_all);
-    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+#ifdef __linux__
+    if (sched_getaffinity(0, sizeof(own), &own) < 0)
+        unix_error("sched_getaffinity error");
+    for (c = 0; c < MAXCPUS && c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &own))
+            addset(&placer.own, c);
+#endif
 
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        struct job_t *job = getjobpid(jobs, pid);
-        if (!job) {
-            printf("sigchld_handler: No job found for PID %d\n", pid);
+    if (readsys("/sys/devices/system/node/online", buf, sizeof(buf)) < 0 ||
+        (n = parselist(buf, &online)) <= 0) {
+        memset(&online, 0, sizeof(online));
+        addset(&online, 0);
+        n = 1;
+    }
+    if ((placer.nodes = calloc(n, sizeof(struct pnode_t))) == NULL ||
+        (placer.cpus = calloc(MAXCPUS, sizeof(struct pcpu_t))) == NULL)
+        unix_error("placeinit: calloc error");
+    for (i = 0; i < MAXCPUS; i++) {
+        if (!inset(&online, i))
             continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+        if (readsys(path, buf, sizeof(buf)) < 0 || parselist(buf, &cpus) < 0) {
+            if (n > 1)
+                continue;
+            cpus = placer.own; // No NUMA information at all
         }
+        for (any = 0, k = 0; k < MAXCPUS / 64; k++)
+            any |= (cpus.bits[k] &= placer.own.bits[k]) != 0;
+        if (!any)
+            continue; // None of its CPUs are ours
+        placer.nodes[placer.nnodes].node = i;
+        placer.nodes[placer.nnodes++].cpus = cpus;
+    }
 
-        if (WIFEXITED(status)) {
-            // If the child exited normally, remove the job from the job list
-            deletejob(jobs, pid);
-            printf("Job [%d] (%d) exited with status %d\n", job->jid, pid, WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            // If the child was terminated by a signal, remove the job from the job list
-            printf("Job [%d] (%d) terminated by signal %d\n", job->jid, pid, WTERMSIG(status));
-            deletejob(jobs, pid);
-        } else if (WIFSTOPPED(status)) {
-            // If the child was stopped by a signal, change the job's state to stopped
-            job->state = ST;
-            printf("Job [%d] (%d) stopped by signal %d\n", job->jid, pid, WSTOPSIG(status));
-        } else if (WIFCONTINUED(status)) {
-            // If the child was continued, change the job's state to background
-            job->state = BG;
-            printf("Job [%d] (%d) continued\n", job->jid, pid);
+    for (c = 0; c < MAXCPUS; c++) {
+        for (i = 0; i < placer.nnodes && !inset(&placer.nodes[i].cpus, c); i++)
+            ;
+        if (i < placer.nnodes) {
+            placer.cpus[placer.ncpus].cpu = c;
+            placer.cpus[placer.ncpus++].node = i;
         }
     }
-
-    sigprocmask(SIG_SETMASK, &prev_all, NULL); // Restore previous blocked signals
-    errno = olderrno; // Restore the saved errno
+    if (placer.ncpus == 0) {
+        outprintf("-a: no CPUs to place jobs on\n");
+        exit(1);
+    }
 }
 
-void sigint_handler(int sig) {
-    int olderrno = errno; // Save current errno
+/*
+ * placebegin - Pick where the next background job goes and run the
+ *    shell there until placeend(), so that the job's processes start
+ *    there. Returns 1 with the CPU (-1 for a whole node) and node in
+ *    *cpu and *node, or 0 if jobs are not placed.
+ */
+int placebegin(int *cpu, int *node) {
+    struct pcpu_t *p, *best;
+    struct pnode_t *nd;
+    int i;
 
-    pid_t fg_pid = fgpid(jobs); // Get the PID of the foreground job
+    if (placer.policy == PL_NONE)
+        return 0;
+    memset(&placer.cur, 0, sizeof(placer.cur));
+    placer.curnode = -1;
 
-    if (fg_pid != 0) {
-        // If there is a foreground job, send SIGINT to the process group of the job
-        kill(-fg_pid, SIGINT);
+    if (placer.policy == PL_NODE) {
+        for (nd = &placer.nodes[0], i = 1; i < placer.nnodes; i++)
+            if (placer.nodes[i].load < nd->load)
+                nd = &placer.nodes[i];
+        nd->load++;
+        placer.cur = nd->cpus;
+        placer.curnode = nd->node;
+        *cpu = -1;
+        *node = nd->node;
+    } else {
+        if (placer.policy == PL_RR) {
+            best = &placer.cpus[placer.next];
+            placer.next = (placer.next + 1) % placer.ncpus;
+        } else {
+            // Ties go to the lowest node, so one fills before the next
+            for (best = &placer.cpus[0], i = 1; i < placer.ncpus; i++) {
+                p = &placer.cpus[i];
+                if (p->load < best->load || (p->load == best->load && p->node < best->node))
+                    best = p;
+            }
+        }
+        best->load++;
+        placer.nodes[best->node].load++;
+        addset(&placer.cur, best->cpu);
+        *cpu = best->cpu;
+        *node = placer.nodes[best->node].node;
     }
 
-    errno = olderrno; // Restore errno
+    setaffinity(&placer.cur);
+    if (placer.curnode >= 0)
+        setmempolicy(placer.curnode);
+    placer.held = 1;
+    return 1;
 }
 
-void sigtstp_handler(int sig) {
-    int olderrno = errno; // Save current errno to prevent side-effects
+/* placeend - Put the shell back on its own CPUs and memory policy */
+void placeend(void) {
+    if (!placer.held)
+        return;
+    setaffinity(&placer.own);
+    if (placer.curnode >= 0)
+        setmempolicy(-1);
+    placer.held = 0;
+}
 
-    pid_t fg_pid = fgpid(jobs); // Get the PID of the foreground job
+/* placedone - A job placed on cpu and node is gone */
+void placedone(int cpu, int node) {
+    int i;
 
-    if (fg_pid != 0) {
-        // If there is a foreground job, send SIGTSTP to the process group of the job
-        kill(-fg_pid, SIGTSTP);
+    for (i = 0; i < placer.ncpus; i++)
+        if (placer.cpus[i].cpu == cpu && placer.cpus[i].load > 0)
+            placer.cpus[i].load--;
+    for (i = 0; i < placer.nnodes; i++)
+        if (placer.nodes[i].node == node && placer.nodes[i].load > 0)
+            placer.nodes[i].load--;
+}
 
-        // Optionally, update the job state to stopped if needed
-        struct job_t *job = getjobpid(jobs, fg_pid);
-        if (job != NULL) {
-            job->state = ST;
-        }
+/* placereport - The jobs -l line for where a job was placed */
+void placereport(const struct job_t *job) {
+    char buf[256];
+    int i;
+
+    if (job->cpu >= 0) {
+        outprintf("    placed on cpu %d, node %d\n", job->cpu, job->node);
+        return;
     }
+    for (i = 0; i < placer.nnodes && placer.nodes[i].node != job->node; i++)
+        ;
+    outprintf("    placed on node %d, cpus %s\n", job->node,
+              i < placer.nnodes ? printlist(buf, sizeof(buf), &placer.nodes[i].cpus) : "?");
+}
 
-    errno = olderrno; // Restore errno to prevent side-effects
+/* setaffinity - Let the calling process run on the CPUs in set only */
+void setaffinity(const struct cpuset_t *set) {
+#ifdef __linux__
+    cpu_set_t cs;
+    int c;
+
+    CPU_ZERO(&cs);
+    for (c = 0; c < MAXCPUS && c < CPU_SETSIZE; c++)
+        if (inset(set, c))
+            CPU_SET(c, &cs);
+    sched_setaffinity(0, sizeof(cs), &cs);
+#endif
 }
 
 /*
- * sigusr1_handler - child is ready
+ * setmempolicy - Have the calling process allocate from NUMA node
+ *    first (falling back on the others when it is full), or as usual
+ *    if node is -1
  */
-void sigusr1_handler(int sig) {
-    ready = 1;
+void setmempolicy(int node) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    struct cpuset_t nodes;
+
+    memset(&nodes, 0, sizeof(nodes));
+    addset(&nodes, node);
+    if (node < 0)
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    else
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes.bits, MAXCPUS + 1);
+#endif
 }
 
+/******************************************************
+ * Helper routines for the output buffer
+ ******************************************************/
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/*
+ * The shell's standard output goes through one ring, so prompts and
+ * job reports that come in bursts cost one write(2) between them.
+ * It is written out by outflush(), which wait_events() calls before
+ * the shell blocks for input or for a child. The ring indices run
+ * free and are only published with atomic stores, so the writer
+ * never takes a lock and never calls stdio. It is only flushed from
+ * the main flow: a flush cut short by a signal has written bytes it
+ * has not yet taken off the ring.
+ */
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/* outwrite - Append n bytes of s to the ring */
+void outwrite(const char *s, size_t n) {
+    unsigned int tail = outq.tail, room, off;
+    size_t k;
+
+    while (n > 0) {
+        room = OUTBUFSIZE - (tail - __atomic_load_n(&outq.head, __ATOMIC_ACQUIRE));
+        if (room == 0) {
+            outflush();
+            continue;
+        }
+        off = tail & (OUTBUFSIZE - 1);
+        k = n;
+        if (k > room)
+            k = room;
+        if (k > OUTBUFSIZE - off)
+            k = OUTBUFSIZE - off;
+        memcpy(outq.buf + off, s, k);
+        tail += k;
+        __atomic_store_n(&outq.tail, tail, __ATOMIC_RELEASE);
+        s += k;
+        n -= k;
+    }
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
+/*
+ * outprintf - printf() into the ring. The text is formatted in place
+ *    when it fits before the end of the ring, else through a copy.
+ */
+void outprintf(const char *fmt, ...) {
+    unsigned int tail = outq.tail, off = tail & (OUTBUFSIZE - 1);
+    unsigned int room = OUTBUFSIZE - (tail - __atomic_load_n(&outq.head, __ATOMIC_ACQUIRE));
+    char small[256], *p = small;
+    va_list ap;
+    int n;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
-}
+    if (room > OUTBUFSIZE - off)
+        room = OUTBUFSIZE - off;
+    va_start(ap, fmt);
+    n = vsnprintf(outq.buf + off, room, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((unsigned int)n < room) {
+        __atomic_store_n(&outq.tail, tail + n, __ATOMIC_RELEASE);
+        return;
+    }
 
-/* freejid - Returns smallest free job ID */
-int freejid(struct job_t *jobs) {
-    int i;
-    int taken[MAXJOBS + 1] = {0};
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid != 0) 
-        taken[jobs[i].jid] = 1;
-    for (i = 1; i <= MAXJOBS; i++)
-        if (!taken[i])
-            return i;
-    return 0;
+    if ((size_t)n >= sizeof(small) && (p = malloc(n + 1)) == NULL)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(p, n + 1, fmt, ap);
+    va_end(ap);
+    outwrite(p, n);
+    if (p != small)
+        free(p);
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
-    
-    if (pid < 1)
-        return 0;
-    int free = freejid(jobs);
-    if (!free) {
-        printf("Tried to create too many jobs\n");
-        return 0;
-    }
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = free;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+/*
+ * outflush - write(2) out everything in the ring. Output the reader
+ *    will never take (a closed pipe, a hung-up terminal) is dropped.
+ */
+void outflush(void) {
+    unsigned int head, tail, off, k;
+    ssize_t n;
+
+#if HAVE_URING
+    if (use_uring)
+        uring_flushwait(); // What the ring is writing comes first
+#endif
+    head = outq.head;
+    while (head != (tail = __atomic_load_n(&outq.tail, __ATOMIC_ACQUIRE))) {
+        off = head & (OUTBUFSIZE - 1);
+        k = tail - head;
+        if (k > OUTBUFSIZE - off)
+            k = OUTBUFSIZE - off;
+        if ((n = write(STDOUT_FILENO, outq.buf + off, k)) < 0) {
+            if (errno == EINTR)
+                continue;
+            head = tail;
+        } else {
+            head += n;
         }
+        __atomic_store_n(&outq.head, head, __ATOMIC_RELEASE);
     }
-    return 0; /*suppress compiler warning*/
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
 
-    if (pid < 1)
-        return 0;
+/******************************************************
+ * Helper routines for the shell statistics
+ ******************************************************/
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            return 1;
-        }
-    }
-    return 0;
+/* nsnow - Monotonic time in nanoseconds */
+static inline uint64_t nsnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/*
+ * histindex - Bucket of v: values below HISTSUB have one each, and
+ *    each power of two above is split into HISTSUB equal buckets
+ */
+static inline int histindex(uint64_t v) {
+    int e;
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-            return jobs[i].pid;
-    return 0;
+    if (v < HISTSUB)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return (e - 3) * HISTSUB + ((v >> (e - 4)) & (HISTSUB - 1));
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* histvalue - Smallest value that goes in bucket i */
+static inline uint64_t histvalue(int i) {
+    if (i < HISTSUB)
+        return i;
+    return (uint64_t)(HISTSUB + i % HISTSUB) << (i / HISTSUB - 1);
+}
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
-    return NULL;
+/* histadd - Record one value */
+void histadd(struct hist_t *h, uint64_t v) {
+    h->bucket[histindex(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
-{
+/* histpct - Value below which a fraction q of the values fall */
+uint64_t histpct(const struct hist_t *h, double q) {
+    uint64_t want = q * h->count + 0.5, seen = 0;
     int i;
 
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < HISTBUCKETS; i++) {
+        if ((seen += h->bucket[i]) >= want)
+            return histvalue(i) > h->max ? h->max : histvalue(i);
+    }
+    return h->max;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
+/* printhist - One line of percentiles of h, in units of scale */
+void printhist(const char *name, const struct hist_t *h, const char *unit, double scale) {
+    outprintf("%-18s n %llu", name, (unsigned long long)h->count);
+    if (h->count > 0)
+        outprintf(", mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f%s",
+               h->sum / scale / h->count, histpct(h, 0.5) / scale, histpct(h, 0.9) / scale,
+               histpct(h, 0.99) / scale, histpct(h, 0.999) / scale, h->max / scale, unit);
+    outprintf("\n");
+}
+
+/* jsonhist - h as a JSON member, its non-empty buckets as [from, count] */
+void jsonhist(FILE *f, const char *name, const struct hist_t *h) {
+    const char *sep = "";
     int i;
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid) {
-            return jobs[i].jid;
+    fprintf(f, "\"%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu, "
+            "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"buckets\": [",
+            name, (unsigned long long)h->count, (unsigned long long)h->sum,
+            (unsigned long long)h->max, (unsigned long long)histpct(h, 0.5),
+            (unsigned long long)histpct(h, 0.9), (unsigned long long)histpct(h, 0.99),
+            (unsigned long long)histpct(h, 0.999));
+    for (i = 0; i < HISTBUCKETS; i++) {
+        if (h->bucket[i] != 0) {
+            fprintf(f, "%s[%llu, %llu]", sep, (unsigned long long)histvalue(i),
+                    (unsigned long long)h->bucket[i]);
+            sep = ", ";
+        }
     }
-    return 0;
+    fprintf(f, "]}");
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-                case BG: 
-                    printf("Running ");
-                    break;
-                case FG: 
-                    printf("Foreground ");
-                    break;
-                case ST: 
-                    printf("Stopped ");
-                    break;
-                default:
-                    printf("listjobs: Internal error: job[%d].state=%d ", 
-                       i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
-        }
+/* statsjson - Write all the counters to f as one JSON object */
+void statsjson(FILE *f) {
+    fprintf(f, "{\"pid\": %d, \"evals\": %llu, \"builtins\": %llu, \"spawns\": %llu, "
+            "\"spawn_failures\": %llu, \"sigchld\": %llu, \"reaps\": %llu, "
+            "\"pooled\": %llu, \"pool_ready\": %d, \"pool_size\": %d, "
+            "\"jobs\": %d, \"jobs_max\": %d, \"job_slots\": %d, ",
+            getpid(), (unsigned long long)stats.evals, (unsigned long long)stats.builtins,
+            (unsigned long long)stats.spawns, (unsigned long long)stats.spawnfails,
+            (unsigned long long)stats.sigchld, (unsigned long long)stats.reaps,
+            (unsigned long long)stats.pooled, npool, poolsize, stats.jobs, stats.jobsmax, jobs->cap);
+    fprintf(f, "\"parse_cache\": {\"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, \"bytes\": %zu}, ",
+            pcache_hits, pcache_misses, pcache_evictions, pcache_bytes);
+    jsonhist(f, "spawn_ns", &stats.spawnlat);
+    fprintf(f, ", ");
+    jsonhist(f, "waitfg_ns", &stats.waitfg);
+    fprintf(f, ", ");
+    jsonhist(f, "reaps_per_sigchld", &stats.sweep);
+    fprintf(f, ", ");
+    jsonhist(f, "event_delay_ns", &stats.evdelay);
+    fprintf(f, "}\n");
+}
+
+/*
+ * dumpstats - Write the stats as JSON to the -s file, or to stderr
+ *    when there is none. Runs on SIGUSR2 and, with -s, at exit.
+ */
+void dumpstats(void) {
+    FILE *f = stderr;
+
+    outflush();
+    if (stats_file != NULL && (f = fopen(stats_file, "w")) == NULL) {
+        outprintf("%s: %s\n", stats_file, strerror(errno));
+        return;
     }
+    statsjson(f);
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+}
+
+/*
+ * do_stats - Execute the builtin stats command: stats prints the
+ *    counters, stats -j prints them as JSON and stats -r zeroes them
+ */
+void do_stats(char **argv) {
+    int njobs = stats.jobs;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-j") == 0) {
+        outflush();
+        statsjson(stdout);
+        fflush(stdout);
+        return;
+    }
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        memset(&stats, 0, sizeof(stats));
+        stats.jobs = stats.jobsmax = njobs;
+        pcache_hits = pcache_misses = pcache_evictions = 0;
+        return;
+    }
+    if (argv[1] != NULL) {
+        outprintf("usage: stats [-j | -r]\n");
+        return;
+    }
+
+    outprintf("%-18s %llu (builtins %llu, processes %llu, failed %llu)\n", "commands",
+           (unsigned long long)stats.evals, (unsigned long long)stats.builtins,
+           (unsigned long long)stats.spawns, (unsigned long long)stats.spawnfails);
+    printhist("spawn latency", &stats.spawnlat, " us", 1e3);
+    printhist("waitfg blocked", &stats.waitfg, " ms", 1e6);
+    outprintf("%-18s %llu, reaps %llu\n", "sigchld",
+           (unsigned long long)stats.sigchld, (unsigned long long)stats.reaps);
+    printhist("reaps per sigchld", &stats.sweep, "", 1);
+    if (stats.evdelay.count > 0)
+        printhist("event delay", &stats.evdelay, " us", 1e3);
+    outprintf("%-18s %d, high-water %d, slots %d\n", "jobs", stats.jobs, stats.jobsmax, jobs->cap);
+    if (poolsize > 0)
+        outprintf("%-18s %d of %d ready, %llu processes started\n", "pool",
+                  npool, poolsize, (unsigned long long)stats.pooled);
+    outprintf("%-18s hits %lu, misses %lu, evictions %lu, %zu bytes\n", "parse cache",
+           pcache_hits, pcache_misses, pcache_evictions, pcache_bytes);
 }
 
 
@@ -588,10 +6789,24 @@ void listjobs(struct job_t *jobs) {
  * usage - print a help message and terminate
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
+    outprintf("Usage: shell [-hvpbFPSU] [-c command] [-f file] [-s file] [-Z n] [-C cgroup] [-a policy] [-H file] [-A path|host:port] [-k file]\n");
+    outprintf("   -h   print this message\n");
+    outprintf("   -v   print additional diagnostic information\n");
+    outprintf("   -p   do not emit a command prompt\n");
+    outprintf("   -b   report background jobs as they change, not before the prompt\n");
+    outprintf("   -F   start jobs with fork() instead of posix_spawn()\n");
+    outprintf("   -P   wait for jobs through pidfds instead of waitpid sweeps\n");
+    outprintf("   -S   splice builtin output into pipelines\n");
+    outprintf("   -U   wait for children, signals, input and output on an io_uring\n");
+    outprintf("   -c   run one command line and exit\n");
+    outprintf("   -f   read commands from a script file\n");
+    outprintf("   -s   write stats as JSON to a file on SIGUSR2 and at exit\n");
+    outprintf("   -Z   keep n forked workers ready to exec commands\n");
+    outprintf("   -C   run each job in its own leaf under a cgroup v2 directory\n");
+    outprintf("   -a   spread background jobs over CPUs: rr, pack or node\n");
+    outprintf("   -H   keep the command history in file, not ~/.tsh_history\n");
+    outprintf("   -A   be the agent of remote jobs on a 0600 Unix socket, or on TCP with a key\n");
+    outprintf("   -k   share the key of TCP agents in file (mode 600), not ~/.tsh_agent_key\n");
     exit(1);
 }
 
@@ -599,7 +6814,7 @@ void usage(void) {
  * unix_error - unix-style error routine
  */
 void unix_error(char *msg) {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    outprintf("%s: %s\n", msg, strerror(errno));
     exit(1);
 }
 
@@ -607,7 +6822,7 @@ void unix_error(char *msg) {
  * app_error - application-style error routine
  */
 void app_error(char *msg) {
-    fprintf(stdout, "%s\n", msg);
+    outprintf("%s\n", msg);
     exit(1);
 }
 
@@ -627,8 +6842,14 @@ handler_t *Signal(int signum, handler_t *handler) {
 }
 
 void sigquit_handler(int sig) {
-    printf("Terminating after receipt of SIGQUIT signal\n");
-    exit(1);
+    static const char msg[] = "Terminating after receipt of SIGQUIT signal\n";
+
+    // Not outflush(): the handler may have cut one short, before it
+    // published what it wrote, and under -U in the middle of the uring
+    if (write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0) {
+        // Nowhere left to report it
+    }
+    _exit(1);
 }
 
 